@@ -1,6 +1,23 @@
+import ipaddress
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome.const import CONF_ID, CONF_PORT
+from esphome import automation
+from esphome.components import number, select, sensor, switch
+from esphome.components.globals import GlobalsComponent
+from esphome.components.logger import LOG_LEVELS
+from esphome.const import (
+    CONF_ADDRESS,
+    CONF_FILE,
+    CONF_FORMAT,
+    CONF_ID,
+    CONF_PORT,
+    CONF_TOPIC,
+    CONF_TRIGGER_ID,
+    PLATFORM_ESP32,
+    PLATFORM_ESP8266,
+)
+from esphome.core import CORE
 
 # ESPHome doesn't know the Stream abstraction yet, so hardcode to use a UART for now.
 
@@ -10,8 +27,156 @@ DEPENDENCIES = ["network"]
 
 MULTI_CONF = True
 
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_ON_CLIENT_CONNECTED = "on_client_connected"
+CONF_ON_CLIENT_DISCONNECTED = "on_client_disconnected"
+CONF_ON_CLIENT_DATA = "on_client_data"
+CONF_MIN_LENGTH = "min_length"
+CONF_STARTS_WITH = "starts_with"
+CONF_CONNECT_TO = "connect_to"
+CONF_MIN_BACKOFF = "min_backoff"
+CONF_MAX_BACKOFF = "max_backoff"
+CONF_BATCH_SIZE = "batch_size"
+CONF_BATCH_TIMEOUT = "batch_timeout"
+CONF_BRIDGE = "bridge"
+CONF_URGENT_BYTES = "urgent_bytes"
+CONF_TELNET_URGENT = "telnet_urgent"
+CONF_PRIORITY = "priority"
+CONF_PRIORITY_RULES = "priority_rules"
+CONF_NETWORK = "network"
+CONF_FLUSH_BUDGET = "flush_budget"
+CONF_FRAME_INDEX_SIZE = "frame_index_size"
+CONF_CHANGES_ONLY = "changes_only"
+CONF_KEYFRAME_INTERVAL = "keyframe_interval"
+CONF_MERGE = "merge"
+CONF_SOURCES = "sources"
+CONF_SOURCE_COUNT = "source_count"
+CONF_TAGGING = "tagging"
+CONF_MQTT_SINK = "mqtt_sink"
+CONF_INTERVAL = "interval"
+CONF_SPLIT = "split"
+CONF_LOG_LEVEL = "log_level"
+CONF_BINARY_LOG = "binary_log"
+CONF_CHANNELS = "channels"
+CONF_CHANNEL_WINDOW = "channel_window"
+CONF_MODBUS = "modbus"
+CONF_SLOTS = "slots"
+CONF_MEMORY_GOVERNOR = "memory_governor"
+CONF_REPLAY = "replay"
+CONF_BENCHMARK = "benchmark"
+CONF_RATE = "rate"
+CONF_METRICS = "metrics"
+CONF_SPEED = "speed"
+CONF_SHRINK = "shrink"
+CONF_REFUSE = "refuse"
+CONF_DROP = "drop"
+CONF_HOLDING_REGISTERS = "holding_registers"
+CONF_INPUT_REGISTERS = "input_registers"
+CONF_SENSOR = "sensor"
+CONF_NUMBER = "number"
+CONF_SWITCH = "switch"
+CONF_SELECT = "select"
+CONF_GLOBAL = "global"
+
 ns = cg.global_ns
 StreamServerComponent = ns.class_("StreamServerComponent", cg.Component)
+StreamView = ns.struct("StreamView")
+SourceTagging = ns.enum("SourceTagging", is_class=True)
+SOURCE_TAGGINGS = {
+    "in_band": SourceTagging.IN_BAND,
+    "frame_index": SourceTagging.FRAME_INDEX,
+}
+RegisterFormat = ns.enum("RegisterFormat", is_class=True)
+REGISTER_FORMATS = {
+    "u16": (RegisterFormat.U16, 1),
+    "s16": (RegisterFormat.S16, 1),
+    "u32": (RegisterFormat.U32, 2),
+    "s32": (RegisterFormat.S32, 2),
+    "float32": (RegisterFormat.FLOAT32, 2),
+}
+ClientPriority = ns.enum("ClientPriority", is_class=True)
+CLIENT_PRIORITIES = {
+    "primary": ClientPriority.PRIMARY,
+    "normal": ClientPriority.NORMAL,
+    "best_effort": ClientPriority.BEST_EFFORT,
+}
+
+ClientConnectedTrigger = ns.class_(
+    "ClientConnectedTrigger", automation.Trigger.template(cg.uint32, cg.std_string)
+)
+ClientDisconnectedTrigger = ns.class_(
+    "ClientDisconnectedTrigger", automation.Trigger.template(cg.uint32, cg.std_string)
+)
+ClientDataTrigger = ns.class_(
+    "ClientDataTrigger", automation.Trigger.template(StreamView, cg.uint32)
+)
+ResizeAction = ns.class_("ResizeAction", automation.Action)
+
+
+def validate_buffer_size(buffer_size):
+    if buffer_size & (buffer_size - 1) != 0:
+        raise cv.Invalid("Buffer size must be a power of two.")
+    return buffer_size
+
+
+def validate_bytes(value):
+    if isinstance(value, str):
+        return list(value.encode("utf-8"))
+    return cv.ensure_list(cv.hex_uint8_t)(value)
+
+
+def validate_network(value):
+    try:
+        return ipaddress.IPv4Network(cv.string_strict(value), strict=False)
+    except ValueError as err:
+        raise cv.Invalid(f"Invalid IPv4 network: {err}")
+
+
+def validate_config(config):
+    if config[CONF_BRIDGE] and CONF_CHANNELS in config:
+        raise cv.Invalid("A bridge can't multiplex channels.")
+    if CONF_MEMORY_GOVERNOR in config:
+        governor = config[CONF_MEMORY_GOVERNOR]
+        if not governor[CONF_SHRINK] > governor[CONF_REFUSE] > governor[CONF_DROP]:
+            raise cv.Invalid(
+                f"The watermarks must decrease from {CONF_SHRINK} to {CONF_REFUSE} to {CONF_DROP}."
+            )
+    if CONF_MODBUS in config and (config[CONF_BRIDGE] or CONF_CHANNELS in config):
+        raise cv.Invalid("Modbus requests can't be answered by a bridge or multiplexer.")
+    if config[CONF_CHANGES_ONLY] and config[CONF_FRAME_INDEX_SIZE] == 0:
+        raise cv.Invalid(f"{CONF_CHANGES_ONLY} requires a {CONF_FRAME_INDEX_SIZE}.")
+    if (
+        CONF_MQTT_SINK in config
+        and config[CONF_MQTT_SINK][CONF_SPLIT] == "frame"
+        and config[CONF_FRAME_INDEX_SIZE] == 0
+    ):
+        raise cv.Invalid(f"Splitting by frame requires a {CONF_FRAME_INDEX_SIZE}.")
+    if CONF_MQTT_SINK in config and "mqtt" not in CORE.loaded_integrations:
+        raise cv.Invalid(f"{CONF_MQTT_SINK} requires the mqtt component.")
+    if CONF_MODBUS in config:
+        for table in (CONF_HOLDING_REGISTERS, CONF_INPUT_REGISTERS):
+            used = set()
+            for reg in config[CONF_MODBUS][table]:
+                width = REGISTER_FORMATS[reg[CONF_FORMAT]][1]
+                addresses = set(range(reg[CONF_ADDRESS], reg[CONF_ADDRESS] + width))
+                if addresses & used or max(addresses) > 0xFFFF:
+                    raise cv.Invalid(
+                        f"Register {reg[CONF_ADDRESS]} overlaps another register."
+                    )
+                used |= addresses
+    if CONF_MERGE in config:
+        merge = config[CONF_MERGE]
+        count = merge.get(CONF_SOURCE_COUNT, len(merge[CONF_SOURCES]))
+        if not 1 <= count <= 16 or len(merge[CONF_SOURCES]) > count:
+            raise cv.Invalid(
+                f"Merge requires 1-16 sources, and at most {CONF_SOURCE_COUNT} {CONF_SOURCES}."
+            )
+        if (
+            merge[CONF_TAGGING] == "frame_index"
+            and config[CONF_FRAME_INDEX_SIZE] == 0
+        ):
+            raise cv.Invalid(f"Tagging by frame index requires a {CONF_FRAME_INDEX_SIZE}.")
+    return config
 
 
 CONFIG_SCHEMA = cv.All(
@@ -20,14 +185,350 @@ CONFIG_SCHEMA = cv.All(
         {
             cv.GenerateID(): cv.declare_id(StreamServerComponent),
             cv.Optional(CONF_PORT, default=6638): cv.port,
+            cv.Optional(CONF_BUFFER_SIZE, default=128): cv.All(
+                cv.positive_int, validate_buffer_size
+            ),
+            cv.Optional(CONF_CONNECT_TO): cv.Schema(
+                {
+                    cv.Required(CONF_ADDRESS): cv.domain,
+                    cv.Required(CONF_PORT): cv.port,
+                    cv.Optional(
+                        CONF_MIN_BACKOFF, default="1s"
+                    ): cv.positive_time_period_milliseconds,
+                    cv.Optional(
+                        CONF_MAX_BACKOFF, default="5min"
+                    ): cv.positive_time_period_milliseconds,
+                    cv.Optional(CONF_BATCH_SIZE, default=1024): cv.positive_int,
+                    cv.Optional(
+                        CONF_BATCH_TIMEOUT, default="100ms"
+                    ): cv.positive_time_period_milliseconds,
+                }
+            ),
+            cv.Optional(CONF_PRIORITY, default="normal"): cv.enum(
+                CLIENT_PRIORITIES, lower=True
+            ),
+            cv.Optional(CONF_PRIORITY_RULES, default=[]): cv.ensure_list(
+                cv.Schema(
+                    {
+                        cv.Required(CONF_NETWORK): validate_network,
+                        cv.Required(CONF_PRIORITY): cv.enum(
+                            CLIENT_PRIORITIES, lower=True
+                        ),
+                    }
+                )
+            ),
+            cv.Optional(
+                CONF_FLUSH_BUDGET, default="0us"
+            ): cv.positive_time_period_microseconds,
+            cv.Optional(CONF_FRAME_INDEX_SIZE, default=0): cv.int_range(min=0),
+            cv.Optional(CONF_CHANGES_ONLY, default=False): cv.boolean,
+            cv.Optional(
+                CONF_KEYFRAME_INTERVAL, default="10s"
+            ): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_MERGE): cv.Schema(
+                {
+                    cv.Optional(CONF_SOURCES, default=[]): cv.ensure_list(
+                        cv.use_id(StreamServerComponent)
+                    ),
+                    cv.Optional(CONF_SOURCE_COUNT): cv.int_range(min=1, max=16),
+                    cv.Optional(CONF_BUFFER_SIZE, default=256): cv.All(
+                        cv.positive_int, validate_buffer_size
+                    ),
+                    cv.Optional(CONF_TAGGING, default="in_band"): cv.one_of(
+                        *SOURCE_TAGGINGS, lower=True
+                    ),
+                }
+            ),
+            cv.Optional(CONF_MQTT_SINK): cv.Schema(
+                {
+                    cv.Required(CONF_TOPIC): cv.publish_topic,
+                    cv.Optional(CONF_BATCH_SIZE, default=1024): cv.int_range(
+                        min=1, max=65535
+                    ),
+                    cv.Optional(
+                        CONF_INTERVAL, default="1s"
+                    ): cv.positive_time_period_milliseconds,
+                    cv.Optional(CONF_SPLIT, default="time"): cv.one_of(
+                        "time", "frame", lower=True
+                    ),
+                }
+            ),
+            cv.Optional(CONF_LOG_LEVEL): cv.All(
+                cv.requires_component("logger"), cv.one_of(*LOG_LEVELS, upper=True)
+            ),
+            cv.Optional(CONF_BINARY_LOG, default=False): cv.boolean,
+            cv.Optional(CONF_BRIDGE, default=False): cv.boolean,
+            cv.Optional(CONF_URGENT_BYTES, default=[]): validate_bytes,
+            cv.Optional(CONF_TELNET_URGENT, default=False): cv.boolean,
+            cv.Optional(CONF_CHANNELS): cv.All(
+                cv.ensure_list(cv.use_id(StreamServerComponent)),
+                cv.Length(min=1, max=15),
+            ),
+            cv.Optional(CONF_CHANNEL_WINDOW, default=4096): cv.int_range(
+                min=2, max=65535
+            ),
+            cv.Optional(CONF_MEMORY_GOVERNOR): cv.All(
+                cv.Schema(
+                    {
+                        cv.Optional(CONF_SHRINK, default=16384): cv.positive_int,
+                        cv.Optional(CONF_REFUSE, default=12288): cv.positive_int,
+                        cv.Optional(CONF_DROP, default=8192): cv.positive_int,
+                        cv.Optional(
+                            CONF_INTERVAL, default="1s"
+                        ): cv.positive_time_period_milliseconds,
+                    }
+                ),
+                # The heap can only be sampled on these platforms.
+                cv.only_on([PLATFORM_ESP32, PLATFORM_ESP8266]),
+            ),
+            cv.Optional(CONF_BENCHMARK): cv.Schema(
+                {
+                    cv.Required(CONF_RATE): cv.int_range(min=16),
+                    cv.Optional(
+                        CONF_INTERVAL, default="10s"
+                    ): cv.positive_time_period_milliseconds,
+                }
+            ),
+            cv.Optional(CONF_METRICS): cv.Schema(
+                {
+                    cv.Optional(CONF_PORT, default=9100): cv.port,
+                }
+            ),
+            cv.Optional(CONF_REPLAY): cv.All(
+                cv.Schema(
+                    {
+                        cv.Required(CONF_FILE): cv.string,
+                        cv.Optional(CONF_SPEED, default="realtime"): cv.one_of(
+                            "realtime", "max", lower=True
+                        ),
+                    }
+                ),
+                cv.only_on("host"),
+            ),
+            cv.Optional(CONF_MODBUS): cv.Schema(
+                {
+                    cv.Optional(CONF_SLOTS, default=4): cv.int_range(min=1, max=32),
+                    cv.Optional(CONF_HOLDING_REGISTERS, default=[]): cv.ensure_list(
+                        cv.Schema(
+                            {
+                                cv.Required(CONF_ADDRESS): cv.uint16_t,
+                                cv.Optional(CONF_FORMAT, default="u16"): cv.one_of(
+                                    *REGISTER_FORMATS, lower=True
+                                ),
+                                cv.Optional(CONF_NUMBER): cv.use_id(
+                                    number.Number
+                                ),
+                                cv.Optional(CONF_SWITCH): cv.use_id(
+                                    switch.Switch
+                                ),
+                                cv.Optional(CONF_SELECT): cv.use_id(
+                                    select.Select
+                                ),
+                                cv.Optional(CONF_GLOBAL): cv.use_id(
+                                    GlobalsComponent
+                                ),
+                            }
+                        ),
+                        cv.has_exactly_one_key(
+                            CONF_NUMBER, CONF_SWITCH, CONF_SELECT, CONF_GLOBAL
+                        ),
+                    ),
+                    cv.Optional(CONF_INPUT_REGISTERS, default=[]): cv.ensure_list(
+                        {
+                            cv.Required(CONF_ADDRESS): cv.uint16_t,
+                            cv.Optional(CONF_FORMAT, default="u16"): cv.one_of(
+                                *REGISTER_FORMATS, lower=True
+                            ),
+                            cv.Required(CONF_SENSOR): cv.use_id(sensor.Sensor),
+                        }
+                    ),
+                }
+            ),
+            cv.Optional(CONF_ON_CLIENT_CONNECTED): automation.validate_automation(
+                {
+                    cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(
+                        ClientConnectedTrigger
+                    ),
+                }
+            ),
+            cv.Optional(CONF_ON_CLIENT_DISCONNECTED): automation.validate_automation(
+                {
+                    cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(
+                        ClientDisconnectedTrigger
+                    ),
+                }
+            ),
+            cv.Optional(CONF_ON_CLIENT_DATA): automation.validate_automation(
+                {
+                    cv.GenerateID(CONF_TRIGGER_ID): cv.declare_id(ClientDataTrigger),
+                    cv.Optional(CONF_MIN_LENGTH, default=0): cv.positive_int,
+                    cv.Optional(CONF_STARTS_WITH, default=[]): validate_bytes,
+                }
+            ),
         }
     )
-    .extend(cv.COMPONENT_SCHEMA)
+    .extend(cv.COMPONENT_SCHEMA),
+    validate_config,
 )
 
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     cg.add(var.set_port(config[CONF_PORT]))
+    cg.add(var.set_buffer_size(config[CONF_BUFFER_SIZE]))
+    if CONF_CONNECT_TO in config:
+        conf = config[CONF_CONNECT_TO]
+        cg.add(var.set_outbound_address(str(conf[CONF_ADDRESS]), conf[CONF_PORT]))
+        cg.add(var.set_outbound_backoff(conf[CONF_MIN_BACKOFF], conf[CONF_MAX_BACKOFF]))
+        # A bridge forwards every byte right away, so it never batches.
+        if not config[CONF_BRIDGE]:
+            cg.add(var.set_batch(conf[CONF_BATCH_SIZE], conf[CONF_BATCH_TIMEOUT]))
+    cg.add(var.set_default_priority(config[CONF_PRIORITY]))
+    for rule in config[CONF_PRIORITY_RULES]:
+        network = rule[CONF_NETWORK]
+        cg.add(
+            var.add_priority_rule(
+                int(network.network_address), int(network.netmask), rule[CONF_PRIORITY]
+            )
+        )
+    cg.add(var.set_flush_budget(config[CONF_FLUSH_BUDGET]))
+    cg.add(var.set_frame_index_size(config[CONF_FRAME_INDEX_SIZE]))
+    cg.add(
+        var.set_changes_only(
+            config[CONF_CHANGES_ONLY], config[CONF_KEYFRAME_INTERVAL]
+        )
+    )
+    if CONF_MERGE in config:
+        merge = config[CONF_MERGE]
+        count = merge.get(CONF_SOURCE_COUNT, len(merge[CONF_SOURCES]))
+        cg.add(
+            var.set_sources(
+                count, merge[CONF_BUFFER_SIZE], SOURCE_TAGGINGS[merge[CONF_TAGGING]]
+            )
+        )
+        for source, source_id in enumerate(merge[CONF_SOURCES]):
+            server = await cg.get_variable(source_id)
+            cg.add(var.add_source(server, source))
+    if CONF_MQTT_SINK in config:
+        conf = config[CONF_MQTT_SINK]
+        cg.add(
+            var.set_sink(
+                conf[CONF_TOPIC],
+                conf[CONF_BATCH_SIZE],
+                conf[CONF_INTERVAL],
+                conf[CONF_SPLIT] == "frame",
+            )
+        )
+    if CONF_LOG_LEVEL in config:
+        cg.add(var.set_log_level(LOG_LEVELS[config[CONF_LOG_LEVEL]]))
+    cg.add(var.set_binary_log(config[CONF_BINARY_LOG]))
+    cg.add(var.set_bridge(config[CONF_BRIDGE]))
+    for byte in config[CONF_URGENT_BYTES]:
+        cg.add(var.add_urgent_byte(byte))
+    if config[CONF_TELNET_URGENT]:
+        cg.add(var.set_telnet_urgent(True))
+    if CONF_CHANNELS in config:
+        cg.add(var.set_channel_window(config[CONF_CHANNEL_WINDOW]))
+        for channel_id in config[CONF_CHANNELS]:
+            channel = await cg.get_variable(channel_id)
+            cg.add(var.add_channel(channel))
+    if CONF_MEMORY_GOVERNOR in config:
+        conf = config[CONF_MEMORY_GOVERNOR]
+        cg.add(
+            var.set_memory_governor(
+                conf[CONF_SHRINK], conf[CONF_REFUSE], conf[CONF_DROP], conf[CONF_INTERVAL]
+            )
+        )
+    if CONF_BENCHMARK in config:
+        conf = config[CONF_BENCHMARK]
+        cg.add(var.set_benchmark(conf[CONF_RATE]))
+        cg.add(var.set_diagnostics_interval(conf[CONF_INTERVAL]))
+    if CONF_METRICS in config:
+        cg.add(var.set_metrics_port(config[CONF_METRICS][CONF_PORT]))
+    if CONF_REPLAY in config:
+        conf = config[CONF_REPLAY]
+        cg.add(var.set_replay(conf[CONF_FILE], conf[CONF_SPEED] == "max"))
+    if CONF_MODBUS in config:
+        cg.add(var.set_modbus(config[CONF_MODBUS][CONF_SLOTS]))
+        for reg in config[CONF_MODBUS][CONF_HOLDING_REGISTERS]:
+            address = reg[CONF_ADDRESS]
+            reg_format = REGISTER_FORMATS[reg[CONF_FORMAT]][0]
+            # The registers follow the state of their entity. Globals only change by writes, so their registers are
+            # loaded from the value of the global at setup instead.
+            state = None
+            read = None
+            if CONF_NUMBER in reg:
+                target = await cg.get_variable(reg[CONF_NUMBER])
+                write = f"{target}->make_call().set_value(value).perform();"
+                state = "[=](float value) { %s }"
+            elif CONF_SWITCH in reg:
+                target = await cg.get_variable(reg[CONF_SWITCH])
+                write = f"value != 0 ? {target}->turn_on() : {target}->turn_off();"
+                state = "[=](bool value) { %s }"
+            elif CONF_SELECT in reg:
+                target = await cg.get_variable(reg[CONF_SELECT])
+                write = f"{target}->make_call().set_index(value).perform();"
+                state = "[=](const std::string &, size_t value) { %s }"
+            else:
+                target = await cg.get_variable(reg[CONF_GLOBAL])
+                write = f"{target}->value() = value;"
+                read = f"[]() -> float {{ return {target}->value(); }}"
+            args = [address, reg_format, cg.RawExpression(f"[](float value) {{ {write} }}")]
+            if read is not None:
+                args.append(cg.RawExpression(read))
+            cg.add(var.add_holding_register(*args))
+            if state is not None:
+                update = f"{var}->set_holding_register({address}, {reg_format}, value);"
+                cg.add(target.add_on_state_callback(cg.RawExpression(state % update)))
+        for reg in config[CONF_MODBUS][CONF_INPUT_REGISTERS]:
+            address = reg[CONF_ADDRESS]
+            reg_format = REGISTER_FORMATS[reg[CONF_FORMAT]][0]
+            target = await cg.get_variable(reg[CONF_SENSOR])
+            cg.add(var.add_input_register(address, reg_format))
+            update = f"{var}->set_input_register({address}, {reg_format}, value);"
+            cg.add(
+                target.add_on_state_callback(
+                    cg.RawExpression(f"[=](float value) {{ {update} }}")
+                )
+            )
 
     await cg.register_component(var, config)
+
+    for conf in config.get(CONF_ON_CLIENT_CONNECTED, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        await automation.build_automation(
+            trigger, [(cg.uint32, "client"), (cg.std_string, "address")], conf
+        )
+    for conf in config.get(CONF_ON_CLIENT_DISCONNECTED, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        await automation.build_automation(
+            trigger, [(cg.uint32, "client"), (cg.std_string, "address")], conf
+        )
+    for conf in config.get(CONF_ON_CLIENT_DATA, []):
+        trigger = cg.new_Pvariable(conf[CONF_TRIGGER_ID], var)
+        cg.add(trigger.set_min_length(conf[CONF_MIN_LENGTH]))
+        if conf[CONF_STARTS_WITH]:
+            cg.add(trigger.set_starts_with(conf[CONF_STARTS_WITH]))
+        await automation.build_automation(
+            trigger, [(StreamView, "data"), (cg.uint32, "client")], conf
+        )
+
+
+@automation.register_action(
+    "stream_server.resize",
+    ResizeAction,
+    cv.Schema(
+        {
+            cv.GenerateID(): cv.use_id(StreamServerComponent),
+            cv.Required(CONF_BUFFER_SIZE): cv.templatable(
+                cv.All(cv.positive_int, validate_buffer_size)
+            ),
+        }
+    ),
+)
+async def resize_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    buffer_size = await cg.templatable(config[CONF_BUFFER_SIZE], args, cg.size_t)
+    cg.add(var.set_buffer_size(buffer_size))
+    return var
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "esphome/core/automation.h"
+#include "stream_server.h"
+
+#include <string>
+#include <vector>
+
+class ClientConnectedTrigger : public esphome::Trigger<uint32_t, std::string> {
+public:
+    explicit ClientConnectedTrigger(StreamServerComponent *parent) {
+        parent->add_on_client_connected_callback(
+            [this](uint32_t client, const std::string &address) { this->trigger(client, address); });
+    }
+};
+
+class ClientDisconnectedTrigger : public esphome::Trigger<uint32_t, std::string> {
+public:
+    explicit ClientDisconnectedTrigger(StreamServerComponent *parent) {
+        parent->add_on_client_disconnected_callback(
+            [this](uint32_t client, const std::string &address) { this->trigger(client, address); });
+    }
+};
+
+// Fires for each batch of data received from a client that matches the filter. The view points into the receive
+// buffer, so it must not be used after the automation has yielded (e.g. after a delay).
+class ClientDataTrigger : public esphome::Trigger<StreamView, uint32_t> {
+public:
+    explicit ClientDataTrigger(StreamServerComponent *parent) {
+        parent->add_on_client_view_callback([this](uint32_t client, StreamView data) {
+            if (data.size >= this->min_length_ && data.starts_with(this->starts_with_))
+                this->trigger(data, client);
+        });
+    }
+
+    void set_min_length(size_t min_length) { this->min_length_ = min_length; }
+    void set_starts_with(const std::vector<uint8_t> &starts_with) { this->starts_with_ = starts_with; }
+
+protected:
+    size_t min_length_{0};
+    std::vector<uint8_t> starts_with_{};
+};
+
+template<typename... Ts> class ResizeAction : public esphome::Action<Ts...>, public esphome::Parented<StreamServerComponent> {
+public:
+    template<typename V> void set_buffer_size(V buffer_size) { this->buffer_size_ = buffer_size; }
+
+    void play(Ts... x) override { this->parent_->resize(this->buffer_size_.value(x...)); }
+
+protected:
+    esphome::TemplatableValue<size_t, Ts...> buffer_size_{};
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Deferred-format binary logging for the hot path. Instead of formatting a message, a log site emits a record with the
+// ID of its format string, a timestamp and the raw arguments, which costs little more than a few stores. The records
+// are decoded into text on the host by tools/decode_binlog.py, which reads the format strings from this table. Each
+// argument is an unsigned 32-bit integer, so only %u and %x can be used. New formats must be appended at the end, to
+// keep the IDs of recorded logs stable. The records of the data path and of connecting clients also make up a trace of
+// a session, which can be replayed on the host platform (see replay.h).
+#define STREAM_SERVER_BINLOG_FORMATS(X) \
+    X(DROPPED, "%u binary log records dropped") \
+    X(READ, "Read %u bytes on port %u from client %u") \
+    X(WRITE, "Wrote %u bytes on port %u to client %u") \
+    X(DROP, "Dropped %u pending bytes for a client on port %u") \
+    X(URGENT, "Passing on %u urgent bytes on port %u") \
+    X(MERGE, "Merged %u bytes from source %u") \
+    X(PUBLISH, "Published %u bytes on port %u") \
+    X(CONNECT, "Client %u connected on port %u") \
+    X(DISCONNECT, "Client %u disconnected on port %u")
+
+enum class BinlogId : uint8_t {
+#define STREAM_SERVER_BINLOG_ID(id, format) id,
+    STREAM_SERVER_BINLOG_FORMATS(STREAM_SERVER_BINLOG_ID)
+#undef STREAM_SERVER_BINLOG_ID
+};
+
+// Number of arguments of each record, for reading recorded logs on the device.
+constexpr uint8_t binlog_argc(const char *format) { return *format == 0 ? 0 : (*format == '%') + binlog_argc(format + 1); }
+static constexpr uint8_t BINLOG_ARGC[] = {
+#define STREAM_SERVER_BINLOG_ARGC(id, format) binlog_argc(format),
+    STREAM_SERVER_BINLOG_FORMATS(STREAM_SERVER_BINLOG_ARGC)
+#undef STREAM_SERVER_BINLOG_ARGC
+};
+
+// Record layout: ID (1 byte), timestamp in microseconds (4 bytes, little-endian), arguments (4 bytes each, little-endian).
+static constexpr size_t BINLOG_HEADER_SIZE = 5;
+
+inline void binlog_put_u32(uint8_t *out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
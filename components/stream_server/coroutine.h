@@ -0,0 +1,22 @@
+#pragma once
+
+// Stackless coroutines for protocol handlers, in the style of protothreads. A coroutine is a function that returns void,
+// and keeps its resume point in a uint16_t in its frame. Locals don't survive a suspension, so all state must live in the
+// frame. CO_AWAIT() suspends the coroutine (returns) until the condition holds when it's called again; the condition is
+// re-evaluated on each resumption.
+#define CO_BEGIN(state) \
+    switch (state) { \
+        case 0:
+
+#define CO_AWAIT(state, condition) \
+    do { \
+        (state) = __LINE__; \
+        /* fall through */ \
+        case __LINE__: \
+            if (!(condition)) \
+                return; \
+    } while (0)
+
+#define CO_END(state) \
+    } \
+    (state) = 0
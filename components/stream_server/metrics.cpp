@@ -0,0 +1,277 @@
+#include "metrics.h"
+#include "stream_server.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+#include "esphome/core/version.h"
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+
+static const char *TAG = "stream_server.metrics";
+
+namespace {
+
+enum Family : uint8_t {
+    PUBLISHED,
+    WRITTEN,
+    READ,
+    DROPPED,
+    CLIENTS,
+    BUFFERED,
+    BUFFER_SIZE,
+    CLIENT_LAG,
+    LOOP_STAGE,
+    LOOP_DURATION,
+    FAMILIES,
+};
+
+struct FamilyInfo {
+    const char *name;
+    const char *type;
+    const char *help;
+};
+
+const FamilyInfo FAMILY_INFO[FAMILIES] = {
+    {"stream_server_published_bytes", "counter", "Bytes appended to the ring."},
+    {"stream_server_written_bytes", "counter", "Bytes written to clients."},
+    {"stream_server_read_bytes", "counter", "Bytes read from clients."},
+    {"stream_server_dropped_bytes", "counter", "Pending bytes dropped because the ring was full or a client fell behind."},
+    {"stream_server_clients", "gauge", "Connected clients."},
+    {"stream_server_buffered_bytes", "gauge", "Bytes retained in the ring."},
+    {"stream_server_buffer_size_bytes", "gauge", "Size of the ring."},
+    {"stream_server_client_lag_bytes", "gauge", "Bytes pending for a client."},
+    {"stream_server_loop_stage_seconds", "counter", "Time spent in each stage of the loop."},
+    {"stream_server_loop_duration_seconds", "histogram", "Duration of a pass of the loop."},
+};
+
+const char *const STAGE_NAMES[] = {"accept", "read", "write", "flush", "housekeeping"};
+
+// Appends to a line of len characters in out. A line that was already cut short is left as it is, so the length is
+// never beyond the buffer.
+int append(char *out, size_t size, int len, const char *format, ...) {
+    if (len < 0 || static_cast<size_t>(len) >= size)
+        return len;
+    va_list args;
+    va_start(args, format);
+    len += vsnprintf(out + len, size - len, format, args);
+    va_end(args);
+    return len;
+}
+
+// Appends a duration in microseconds as seconds, without floating point.
+int seconds(char *out, size_t size, int len, uint64_t us) {
+    return append(out, size, len, "%" PRIu64 ".%06u", us / 1000000, static_cast<unsigned>(us % 1000000));
+}
+
+}  // namespace
+
+void MetricsEndpoint::setup() {
+    struct sockaddr_storage bind_addr;
+#if ESPHOME_VERSION_CODE >= VERSION_CODE(2023, 4, 0)
+    socklen_t bind_addrlen = esphome::socket::set_sockaddr_any(reinterpret_cast<struct sockaddr *>(&bind_addr), sizeof(bind_addr), this->port_);
+#else
+    socklen_t bind_addrlen = esphome::socket::set_sockaddr_any(reinterpret_cast<struct sockaddr *>(&bind_addr), sizeof(bind_addr), htons(this->port_));
+#endif
+
+    this->socket_ = esphome::socket::socket_ip(SOCK_STREAM, PF_INET);
+    this->socket_->setblocking(false);
+    this->socket_->bind(reinterpret_cast<struct sockaddr *>(&bind_addr), bind_addrlen);
+    this->socket_->listen(2);
+}
+
+void MetricsEndpoint::loop() {
+    if (this->socket_ == nullptr)
+        return;
+
+    if (this->state_ == State::IDLE) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        this->client_ = this->socket_->accept(reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
+        if (!this->client_)
+            return;
+        this->client_->setblocking(false);
+        this->state_ = State::REQUEST;
+        this->request_end_ = 0;
+        this->accepted_ = esphome::millis();
+    }
+
+    // A scraper that stalls, before sending its request or while taking the response, would keep the endpoint busy.
+    if (esphome::millis() - this->accepted_ > TIMEOUT_MS) {
+        ESP_LOGW(TAG, "Metrics scrape timed out");
+        this->close();
+        return;
+    }
+
+    if (this->state_ == State::REQUEST) {
+        // Every request is answered with the metrics, once the blank line that ends its headers has been read.
+        static const char END[] = "\r\n\r\n";
+        char buf[64];
+        ssize_t read;
+        while (this->request_end_ < 4 && (read = this->client_->read(buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < read && this->request_end_ < 4; i++) {
+                if (buf[i] == END[this->request_end_])
+                    this->request_end_++;
+                else
+                    this->request_end_ = buf[i] == '\r' ? 1 : 0;
+            }
+        }
+        if (this->request_end_ < 4) {
+            if (read == 0 || (errno != EWOULDBLOCK && errno != EAGAIN))
+                this->close();
+            return;
+        }
+
+        this->state_ = State::RESPONSE;
+        this->cursor_ = Cursor{};
+        this->buf_len_ = snprintf(this->buf_, sizeof(this->buf_),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                  "Connection: close\r\n\r\n");
+        this->buf_sent_ = 0;
+    }
+
+    while (true) {
+        if (this->buf_sent_ == this->buf_len_) {
+            // Refill the buffer with as many lines as fit.
+            this->buf_len_ = this->buf_sent_ = 0;
+            while (sizeof(this->buf_) - this->buf_len_ >= LINE_SIZE) {
+                size_t len = this->render(&this->buf_[this->buf_len_], LINE_SIZE);
+                if (len == 0)
+                    break;
+                this->buf_len_ += len;
+            }
+            if (this->buf_len_ == 0) {
+                this->close();
+                return;
+            }
+        }
+
+        ssize_t written = this->client_->write(&this->buf_[this->buf_sent_], this->buf_len_ - this->buf_sent_);
+        if (written < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                ESP_LOGW(TAG, "Failed to write metrics with error %d", errno);
+                this->close();
+            }
+            return;
+        }
+        this->buf_sent_ += written;
+    }
+}
+
+void MetricsEndpoint::close() {
+    this->client_->close();
+    this->client_.reset();
+    this->state_ = State::IDLE;
+}
+
+size_t MetricsEndpoint::render(char *out, size_t size) {
+    // Each call renders the line at the cursor and advances it. Lines that don't fit are cut short, but still end the
+    // line, so the output stays parseable.
+    const auto &servers = StreamServerComponent::instances_;
+    Cursor &cursor = this->cursor_;
+    while (!cursor.done) {
+        if (cursor.family == FAMILIES) {
+            cursor.done = true;
+            return snprintf(out, size, "# EOF\n");
+        }
+
+        const FamilyInfo &info = FAMILY_INFO[cursor.family];
+        int len = 0;
+        if (!cursor.described) {
+            cursor.described = true;
+            len = snprintf(out, size, "# TYPE %s %s\n# HELP %s %s\n", info.name, info.type, info.name, info.help);
+        } else if (cursor.server < servers.size()) {
+            len = this->render_sample(out, size, *servers[cursor.server]);
+            if (len > 0) {
+                cursor.item++;
+            } else {
+                cursor.server++;
+                cursor.item = 0;
+                continue;
+            }
+        } else {
+            cursor.family++;
+            cursor.described = false;
+            cursor.server = 0;
+            cursor.item = 0;
+            continue;
+        }
+
+        if (len >= (int) size) {
+            len = size - 1;
+            out[len - 1] = '\n';
+        }
+        return len;
+    }
+    return 0;
+}
+
+size_t MetricsEndpoint::render_sample(char *out, size_t size, const StreamServerComponent &server) {
+    const FamilyInfo &info = FAMILY_INFO[this->cursor_.family];
+    uint16_t item = this->cursor_.item;
+    uint16_t port = server.port_;
+    int len;
+
+    switch (this->cursor_.family) {
+        case PUBLISHED:
+        case WRITTEN:
+        case READ:
+        case DROPPED: {
+            if (item > 0)
+                return 0;
+            uint64_t value = this->cursor_.family == PUBLISHED ? server.buf_head_
+                             : this->cursor_.family == WRITTEN ? server.bytes_written_
+                             : this->cursor_.family == READ    ? server.bytes_read_
+                                                               : server.bytes_dropped_;
+            return snprintf(out, size, "%s_total{port=\"%u\"} %" PRIu64 "\n", info.name, port, value);
+        }
+        case CLIENTS:
+        case BUFFERED:
+        case BUFFER_SIZE: {
+            if (item > 0)
+                return 0;
+            size_t value = this->cursor_.family == CLIENTS    ? server.clients_.size()
+                           : this->cursor_.family == BUFFERED ? server.buf_head_ - server.buf_tail_
+                                                              : server.buf_size_;
+            return snprintf(out, size, "%s{port=\"%u\"} %u\n", info.name, port, static_cast<unsigned>(value));
+        }
+        case CLIENT_LAG: {
+            if (item >= server.clients_.size())
+                return 0;
+            const auto &client = server.clients_[item];
+            // The address isn't unique, as clients may connect from the same host, so the series is keyed by number.
+            return snprintf(out, size, "%s{port=\"%u\",client=\"%u\",address=\"%s\"} %u\n", info.name, port,
+                            static_cast<unsigned>(client.number), client.identifier.c_str(),
+                            static_cast<unsigned>(server.buf_head_ - client.position));
+        }
+        case LOOP_STAGE:
+            if (item >= StreamServerComponent::LOOP_STAGES)
+                return 0;
+            len = snprintf(out, size, "%s_total{port=\"%u\",stage=\"%s\"} ", info.name, port, STAGE_NAMES[item]);
+            len = seconds(out, size, len, server.stage_time_[item]);
+            return append(out, size, len, "\n");
+        case LOOP_DURATION:
+            // The buckets, then the sum and the count.
+            if (item < StreamServerComponent::LOOP_BUCKETS) {
+                uint32_t count = 0;
+                for (uint16_t i = 0; i <= item; i++)
+                    count += server.loop_buckets_[i];
+                len = snprintf(out, size, "%s_bucket{port=\"%u\",le=\"", info.name, port);
+                len = seconds(out, size, len, StreamServerComponent::LOOP_BUCKET_US[item]);
+                return append(out, size, len, "\"} %u\n", count);
+            } else if (item == StreamServerComponent::LOOP_BUCKETS) {
+                return snprintf(out, size, "%s_bucket{port=\"%u\",le=\"+Inf\"} %u\n", info.name, port, server.loop_count_total_);
+            } else if (item == StreamServerComponent::LOOP_BUCKETS + 1) {
+                len = snprintf(out, size, "%s_sum{port=\"%u\"} ", info.name, port);
+                len = seconds(out, size, len, server.loop_time_total_);
+                return append(out, size, len, "\n");
+            } else if (item == StreamServerComponent::LOOP_BUCKETS + 2) {
+                return snprintf(out, size, "%s_count{port=\"%u\"} %u\n", info.name, port, server.loop_count_total_);
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "esphome/components/socket/socket.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class StreamServerComponent;
+
+// Serves the metrics of all stream servers over HTTP, in the OpenMetrics text format that Prometheus scrapes. The
+// response is rendered one line at a time into a fixed buffer that is written straight into the socket, so a scrape
+// doesn't allocate, and a slow scraper doesn't block the loop: rendering resumes where it left off in the next pass.
+class MetricsEndpoint {
+public:
+    explicit MetricsEndpoint(uint16_t port) : port_(port) {}
+
+    void setup();
+    void loop();
+
+    uint16_t get_port() const { return this->port_; }
+
+protected:
+    enum class State : uint8_t { IDLE, REQUEST, RESPONSE };
+
+    // Position in the response: a metric family, a server and an item within it (a client, a bucket, a stage).
+    struct Cursor {
+        uint8_t family;
+        bool described;
+        uint8_t server;
+        uint16_t item;
+        bool done;
+    };
+
+    size_t render(char *out, size_t size);
+    size_t render_sample(char *out, size_t size, const StreamServerComponent &server);
+    void close();
+
+    static constexpr size_t LINE_SIZE = 160;
+    static constexpr uint32_t TIMEOUT_MS = 5000;
+
+    uint16_t port_;
+    std::unique_ptr<esphome::socket::Socket> socket_{};
+    std::unique_ptr<esphome::socket::Socket> client_{};
+    State state_{State::IDLE};
+    uint32_t accepted_{0};    // When the current scrape was accepted, in ms
+    uint8_t request_end_{0};  // Number of bytes of the blank line that ends the request headers seen so far
+    Cursor cursor_{};
+    char buf_[4 * LINE_SIZE];
+    size_t buf_len_{0};
+    size_t buf_sent_{0};
+};
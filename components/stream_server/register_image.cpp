@@ -0,0 +1,66 @@
+#include "register_image.h"
+
+void RegisterImage::include(uint16_t address, uint16_t count) {
+    // Only used during configuration, so the image is simply reallocated.
+    Range added{address, uint32_t(address) + count, 0};
+    auto it = std::lower_bound(this->ranges_.begin(), this->ranges_.end(), added,
+                               [](const Range &a, const Range &b) { return a.begin < b.begin; });
+    it = this->ranges_.insert(it, added);
+    if (it != this->ranges_.begin())
+        it--;
+    while (it + 1 != this->ranges_.end()) {
+        if ((it + 1)->begin > it->end + MERGE_GAP) {
+            it++;
+            continue;
+        }
+        it->end = std::max(it->end, (it + 1)->end);
+        this->ranges_.erase(it + 1);
+    }
+
+    this->size_ = 0;
+    for (Range &range : this->ranges_) {
+        range.offset = this->size_;
+        this->size_ += range.end - range.begin;
+    }
+    this->registers_ = std::unique_ptr<std::atomic<uint16_t>[]>{new std::atomic<uint16_t>[this->size_]};
+    for (uint32_t i = 0; i < this->size_; i++)
+        this->registers_[i].store(0, std::memory_order_relaxed);
+}
+
+int32_t RegisterImage::find(uint16_t address, uint16_t count) const {
+    for (const Range &range : this->ranges_) {
+        if (address >= range.begin && uint32_t(address) + count <= range.end)
+            return range.offset + (address - range.begin);
+    }
+    return -1;
+}
+
+void RegisterImage::write(uint16_t address, const uint16_t *values, uint16_t count) {
+    int32_t index = this->find(address, count);
+    if (index < 0)
+        return;
+
+    // An odd sequence number marks an update in progress.
+    uint32_t sequence = this->sequence_.load(std::memory_order_relaxed);
+    this->sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint16_t i = 0; i < count; i++)
+        this->registers_[index + i].store(values[i], std::memory_order_relaxed);
+    this->sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+bool RegisterImage::read(uint16_t address, uint16_t *values, uint16_t count) const {
+    int32_t index = this->find(address, count);
+    if (index < 0)
+        return false;
+
+    uint32_t before, after;
+    do {
+        before = this->sequence_.load(std::memory_order_acquire);
+        for (uint16_t i = 0; i < count; i++)
+            values[i] = this->registers_[index + i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = this->sequence_.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Image of a table of Modbus registers, protected by a sequence lock. Updates of a value never block, and a reader that
+// overlaps an update retries, so a multi-register read is always a consistent snapshot even if it's served from another
+// task or core. There is a single writer. The image holds the included registers as a list of ranges, so a sparse map
+// doesn't cost the whole address space; ranges that are close together are merged, so reads may span small gaps.
+class RegisterImage {
+public:
+    void include(uint16_t address, uint16_t count);
+
+    void write(uint16_t address, const uint16_t *values, uint16_t count);
+    bool read(uint16_t address, uint16_t *values, uint16_t count) const;
+
+    size_t memory_usage() const {
+        return this->size_ * sizeof(std::atomic<uint16_t>) + this->ranges_.capacity() * sizeof(Range);
+    }
+
+protected:
+    struct Range {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t offset;  // Index of the first register of the range in registers_
+    };
+
+    // Gap up to which adjacent ranges are merged.
+    static constexpr uint32_t MERGE_GAP = 8;
+
+    // Index in registers_ of the given registers, or -1 when they aren't all in one range.
+    int32_t find(uint16_t address, uint16_t count) const;
+
+    std::unique_ptr<std::atomic<uint16_t>[]> registers_{};
+    std::vector<Range> ranges_{};
+    uint32_t size_{0};
+    std::atomic<uint32_t> sequence_{0};
+};
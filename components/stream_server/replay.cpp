@@ -0,0 +1,252 @@
+#ifdef USE_HOST
+
+#include "replay.h"
+#include "stream_server.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const char *TAG = "stream_server.replay";
+
+ReplaySocket::~ReplaySocket() {
+    if (this->replay != nullptr)
+        this->replay->sockets_.erase(this->number);
+}
+
+ssize_t ReplaySocket::read(void *buf, size_t len) {
+    if (this->readable == 0) {
+        if (this->hung_up)
+            return 0;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    len = std::min(len, this->readable);
+    std::memset(buf, 0, len);
+    this->readable -= len;
+    return len;
+}
+
+ssize_t ReplaySocket::readv(const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t read = this->read(iov[i].iov_base, iov[i].iov_len);
+        if (read <= 0)
+            return total > 0 ? total : read;
+        total += read;
+    }
+    return total;
+}
+
+ssize_t ReplaySocket::write(const void *buf, size_t len) {
+    struct iovec iov = {const_cast<void *>(buf), len};
+    return this->writev(&iov, 1);
+}
+
+ssize_t ReplaySocket::writev(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    len = std::min(len, this->window);
+    if (len == 0) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    this->window -= len;
+    if (this->replay != nullptr)
+        this->replay->delivered(this, len);
+    return len;
+}
+
+TraceReplay::~TraceReplay() {
+    // The clients that are still connected hang up.
+    for (auto &entry : this->sockets_) {
+        entry.second->replay = nullptr;
+        entry.second->hung_up = true;
+    }
+    if (this->file_ != nullptr)
+        fclose(this->file_);
+    this->high_freq_.stop();
+}
+
+bool TraceReplay::step(StreamServerComponent &server, uint32_t now) {
+    if (!this->started_) {
+        this->started_ = true;
+        this->file_ = fopen(this->path_.c_str(), "rb");
+        if (this->file_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to open trace %s", this->path_.c_str());
+            return false;
+        }
+        ESP_LOGI(TAG, "Replaying trace %s %s", this->path_.c_str(), this->max_speed_ ? "at maximum speed" : "in real time");
+        this->start_ = this->now_ = now;
+        // Otherwise the main loop sleeps between passes, which would limit the speed of the replay.
+        if (this->max_speed_)
+            this->high_freq_.start();
+    }
+
+    this->elapsed_ += now - this->now_;
+    this->now_ = now;
+    if (!this->loaded_ && !this->load()) {
+        this->report(now);
+        return false;
+    }
+    // At maximum speed the replay jumps ahead to the next event, so the events of one instant are applied per loop.
+    if (this->max_speed_)
+        this->elapsed_ = std::max(this->elapsed_, this->event_time_);
+
+    while (this->event_time_ <= this->elapsed_) {
+        this->apply(server, now);
+        if (!this->load()) {
+            this->report(now);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TraceReplay::load() {
+    uint8_t header[BINLOG_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, this->file_) != 1)
+        return false;
+
+    this->loaded_ = false;
+    if (header[0] >= sizeof(BINLOG_ARGC)) {
+        ESP_LOGE(TAG, "Unknown record ID %u, trace is corrupt", header[0]);
+        return false;
+    }
+    uint8_t args[16];
+    uint8_t argc = BINLOG_ARGC[header[0]];
+    if (fread(args, 4, argc, this->file_) != argc)
+        return false;
+
+    this->event_.id = static_cast<BinlogId>(header[0]);
+    this->event_.timestamp = header[1] | header[2] << 8 | header[3] << 16 | (uint32_t) header[4] << 24;
+    for (uint8_t i = 0; i < argc; i++)
+        this->event_.args[i] = args[4 * i] | args[4 * i + 1] << 8 | args[4 * i + 2] << 16 | (uint32_t) args[4 * i + 3] << 24;
+
+    // Timestamps wrap around, so the time of the trace is accumulated from the differences.
+    if (this->events_ > 0)
+        this->event_time_ += this->event_.timestamp - this->last_timestamp_;
+    this->last_timestamp_ = this->event_.timestamp;
+    this->events_++;
+    this->loaded_ = true;
+    return true;
+}
+
+void TraceReplay::apply(StreamServerComponent &server, uint32_t now) {
+    const Event &event = this->event_;
+    auto socket = [this](uint32_t number) -> ReplaySocket * {
+        auto it = this->sockets_.find(number);
+        return it != this->sockets_.end() ? it->second : nullptr;
+    };
+
+    switch (event.id) {
+        case BinlogId::PUBLISH:
+            if (event.args[1] == server.port_) {
+                // The data itself isn't recorded, so a pattern is published instead.
+                uint8_t data[256];
+                for (size_t done = 0; done < event.args[0]; done += sizeof(data)) {
+                    size_t len = std::min<size_t>(sizeof(data), event.args[0] - done);
+                    std::memset(data, 'A' + (this->first_published_ + this->published_.size()) % 26, len);
+                    server.publish(data, len);
+                }
+                this->offset_ += event.args[0];
+                this->published_.emplace_back(this->offset_, now);
+                this->trim();
+            }
+            break;
+        case BinlogId::CONNECT:
+            if (event.args[1] == server.port_ && socket(event.args[0]) == nullptr) {
+                auto *client = new ReplaySocket(this, event.args[0]);
+                client->position = this->offset_;
+                client->next = this->first_published_ + this->published_.size();
+                this->sockets_[event.args[0]] = client;
+                server.add_client(std::unique_ptr<esphome::socket::Socket>(client), client->getpeername(),
+                                  server.default_priority_);
+            }
+            break;
+        case BinlogId::READ:
+            if (event.args[1] == server.port_ && socket(event.args[2]) != nullptr)
+                socket(event.args[2])->readable += event.args[0];
+            break;
+        case BinlogId::WRITE:
+            if (event.args[1] == server.port_ && socket(event.args[2]) != nullptr)
+                socket(event.args[2])->window += event.args[0];
+            break;
+        case BinlogId::DISCONNECT:
+            if (event.args[1] == server.port_ && socket(event.args[0]) != nullptr)
+                socket(event.args[0])->hung_up = true;
+            break;
+        default:
+            break;
+    }
+}
+
+void TraceReplay::delivered(ReplaySocket *socket, size_t len) {
+    // The latency of a publish is taken when its last byte is written. This assumes that the client receives the stream
+    // without gaps, so it's skewed for clients that lose data.
+    socket->received += len;
+    this->delivered_ += len;
+    size_t reached = socket->position + socket->received;
+    uint32_t now = esphome::micros();
+    size_t end = this->first_published_ + this->published_.size();
+    while (socket->next < end && this->published_[socket->next - this->first_published_].first <= reached) {
+        this->latencies_.add(now - this->published_[socket->next - this->first_published_].second);
+        socket->next++;
+    }
+    this->trim();
+}
+
+void TraceReplay::trim() {
+    // Publishes are only needed until every client received them, so long traces don't accumulate them.
+    size_t next = this->first_published_ + this->published_.size();
+    for (auto &entry : this->sockets_)
+        next = std::min(next, entry.second->next);
+    while (this->first_published_ < next) {
+        this->published_.pop_front();
+        this->first_published_++;
+    }
+}
+
+void TraceReplay::Series::add(uint32_t value) {
+    this->max = std::max(this->max, value);
+    if (++this->skipped < this->stride)
+        return;
+    this->skipped = 0;
+    if (this->values.size() == MAX_SAMPLES) {
+        for (size_t i = 0; i < MAX_SAMPLES / 2; i++)
+            this->values[i] = this->values[2 * i + 1];
+        this->values.resize(MAX_SAMPLES / 2);
+        this->stride *= 2;
+    }
+    this->values.push_back(value);
+}
+
+static uint32_t percentile(std::vector<uint32_t> &values, unsigned percent) {
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, values.size() * percent / 100);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+void TraceReplay::report(uint32_t now) {
+    float seconds = (now - this->start_) / 1e6f;
+    ESP_LOGI(TAG, "Replay of %u events finished in %.1f s", this->events_, seconds);
+    if (seconds > 0) {
+        ESP_LOGI(TAG, "  Published: %zu bytes, %.1f KB/s", this->offset_, this->offset_ / seconds / 1024);
+        ESP_LOGI(TAG, "  Delivered: %zu bytes, %.1f KB/s", this->delivered_, this->delivered_ / seconds / 1024);
+    }
+    for (auto *series : {&this->latencies_, &this->loop_times_}) {
+        std::vector<uint32_t> &values = series->values;
+        ESP_LOGI(TAG, "  %s (us): p50 %u, p90 %u, p99 %u, max %u (%zu samples)",
+                 series == &this->latencies_ ? "Latency" : "Loop time", percentile(values, 50), percentile(values, 90),
+                 percentile(values, 99), series->max, values.size());
+    }
+}
+
+#endif
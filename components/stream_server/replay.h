@@ -0,0 +1,132 @@
+#pragma once
+
+#ifdef USE_HOST
+
+#include "esphome/components/socket/socket.h"
+#include "esphome/core/helpers.h"
+
+#include "binlog.h"
+
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class StreamServerComponent;
+class TraceReplay;
+
+// Socket of a replayed client. The trace only has the sizes of the data, so what the client sent reads as zeroes.
+// Writes are accepted up to what the client took at the same point of the recorded session, so slow clients stay slow.
+class ReplaySocket : public esphome::socket::Socket {
+public:
+    ReplaySocket(TraceReplay *replay, uint32_t number) : replay(replay), number(number) {}
+    ~ReplaySocket() override;
+
+    std::unique_ptr<esphome::socket::Socket> accept(struct sockaddr *addr, socklen_t *addrlen) override { return nullptr; }
+    int bind(const struct sockaddr *addr, socklen_t addrlen) override { return this->unsupported(); }
+    int close() override { return 0; }
+    int connect(const struct sockaddr *addr, socklen_t addrlen) override { return this->unsupported(); }
+    int shutdown(int how) override { return 0; }
+    int getpeername(struct sockaddr *addr, socklen_t *addrlen) override { return this->unsupported(); }
+    std::string getpeername() override { return "replay-" + std::to_string(this->number); }
+    int getsockname(struct sockaddr *addr, socklen_t *addrlen) override { return this->unsupported(); }
+    std::string getsockname() override { return "replay"; }
+    int getsockopt(int level, int optname, void *optval, socklen_t *optlen) override { return this->unsupported(); }
+    int setsockopt(int level, int optname, const void *optval, socklen_t optlen) override { return 0; }
+    int listen(int backlog) override { return this->unsupported(); }
+    ssize_t read(void *buf, size_t len) override;
+    ssize_t readv(const struct iovec *iov, int iovcnt) override;
+    ssize_t write(const void *buf, size_t len) override;
+    ssize_t writev(const struct iovec *iov, int iovcnt) override;
+    ssize_t sendto(const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) override {
+        return this->unsupported();
+    }
+    int setblocking(bool blocking) override { return 0; }
+
+    TraceReplay *replay;
+    uint32_t number;
+    size_t readable{0};   // Bytes the client sent that weren't read yet
+    bool hung_up{false};  // Whether the client disconnected
+    size_t window{0};     // Bytes the client will take
+    size_t position{0};   // Offset in the replayed stream where the client connected
+    size_t received{0};   // Bytes written to the client
+    size_t next{0};       // First publish that the client didn't receive completely yet
+
+protected:
+    int unsupported() {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+};
+
+// Replays a session recorded in the binary log against a stream server, through ReplaySockets, either in real time or
+// as fast as possible by skipping the idle time between events. The records of the port of the server are replayed:
+// published data, clients connecting, sending and disconnecting, and the data clients took. At the end of the trace,
+// the throughput and the distributions of the latency (from publishing to writing to a client) and of the loop time
+// are logged.
+class TraceReplay {
+public:
+    TraceReplay(std::string path, bool max_speed) : path_(std::move(path)), max_speed_(max_speed) {}
+    ~TraceReplay();
+
+    // Apply the events that are due, returns false at the end of the trace.
+    bool step(StreamServerComponent &server, uint32_t now);
+    void record_loop(uint32_t duration) { this->loop_times_.add(duration); }
+
+protected:
+    friend class ReplaySocket;
+
+    // Samples of a distribution, bounded for long traces: when full, every other sample is dropped and from then on
+    // only every other one is kept, so the samples stay spread evenly over the trace.
+    struct Series {
+        static constexpr size_t MAX_SAMPLES = 1 << 16;
+
+        void add(uint32_t value);
+
+        std::vector<uint32_t> values{};
+        uint32_t max{0};  // Of all values, not only the samples
+        uint32_t stride{1};
+        uint32_t skipped{0};
+    };
+
+    struct Event {
+        BinlogId id;
+        uint32_t timestamp;
+        uint32_t args[4];
+    };
+
+    bool load();
+    void apply(StreamServerComponent &server, uint32_t now);
+    void delivered(ReplaySocket *socket, size_t len);
+    void trim();
+    void report(uint32_t now);
+
+    std::string path_;
+    bool max_speed_;
+    FILE *file_{nullptr};
+    bool started_{false};
+    bool loaded_{false};
+    Event event_{};
+    uint64_t event_time_{0};  // Time of the loaded event since the start of the trace, in us
+    uint32_t last_timestamp_{0};
+    uint64_t elapsed_{0};  // Time since the start of the replay, in us
+    uint32_t start_{0};
+    uint32_t now_{0};
+    uint32_t events_{0};
+
+    esphome::HighFrequencyLoopRequester high_freq_{};
+
+    std::map<uint32_t, ReplaySocket *> sockets_{};
+    // End offset of each publish, and when it was published. Publishes that every client received are trimmed, and
+    // first_published_ is the number of the first one that is left.
+    std::deque<std::pair<size_t, uint32_t>> published_{};
+    size_t first_published_{0};
+    size_t offset_{0};
+    size_t delivered_{0};
+    Series latencies_{};
+    Series loop_times_{};
+};
+
+#endif
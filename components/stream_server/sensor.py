@@ -2,22 +2,85 @@ import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import sensor
 from esphome.const import (
+    CONF_UPDATE_INTERVAL,
     STATE_CLASS_MEASUREMENT,
     ENTITY_CATEGORY_DIAGNOSTIC,
+    UNIT_BYTES,
+    UNIT_MICROSECOND,
+    UNIT_PERCENT,
 )
 from . import ns, StreamServerComponent
 
 CONF_CONNECTION_COUNT = "connection_count"
+CONF_MEMORY_USAGE = "memory_usage"
+CONF_HEAP_LARGEST_BLOCK = "heap_largest_block"
+CONF_HEAP_FRAGMENTATION = "heap_fragmentation"
+CONF_MEMORY_PRESSURE = "memory_pressure"
+CONF_BENCHMARK_THROUGHPUT = "benchmark_throughput"
+CONF_BENCHMARK_LOOP_TIME = "benchmark_loop_time"
+CONF_BENCHMARK_DROP_RATE = "benchmark_drop_rate"
 CONF_STREAM_SERVER = "stream_server"
 
+DIAGNOSTICS = [
+    CONF_MEMORY_USAGE,
+    CONF_HEAP_LARGEST_BLOCK,
+    CONF_HEAP_FRAGMENTATION,
+    CONF_BENCHMARK_THROUGHPUT,
+    CONF_BENCHMARK_LOOP_TIME,
+    CONF_BENCHMARK_DROP_RATE,
+]
+
 CONFIG_SCHEMA = cv.Schema(
     {
         cv.GenerateID(CONF_STREAM_SERVER): cv.use_id(StreamServerComponent),
-        cv.Required(CONF_CONNECTION_COUNT): sensor.sensor_schema(
+        cv.Optional(CONF_CONNECTION_COUNT): sensor.sensor_schema(
             accuracy_decimals=0,
             state_class=STATE_CLASS_MEASUREMENT,
             entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
         ),
+        cv.Optional(CONF_MEMORY_USAGE): sensor.sensor_schema(
+            unit_of_measurement=UNIT_BYTES,
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_HEAP_LARGEST_BLOCK): sensor.sensor_schema(
+            unit_of_measurement=UNIT_BYTES,
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_HEAP_FRAGMENTATION): sensor.sensor_schema(
+            unit_of_measurement=UNIT_PERCENT,
+            accuracy_decimals=1,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_MEMORY_PRESSURE): sensor.sensor_schema(
+            accuracy_decimals=0,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_BENCHMARK_THROUGHPUT): sensor.sensor_schema(
+            unit_of_measurement="B/s",
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_BENCHMARK_LOOP_TIME): sensor.sensor_schema(
+            unit_of_measurement=UNIT_MICROSECOND,
+            accuracy_decimals=1,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(CONF_BENCHMARK_DROP_RATE): sensor.sensor_schema(
+            unit_of_measurement=UNIT_PERCENT,
+            accuracy_decimals=2,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        cv.Optional(
+            CONF_UPDATE_INTERVAL, default="60s"
+        ): cv.positive_time_period_milliseconds,
     }
 )
 
@@ -25,5 +88,17 @@ CONFIG_SCHEMA = cv.Schema(
 async def to_code(config):
     server = await cg.get_variable(config[CONF_STREAM_SERVER])
 
-    sens = await sensor.new_sensor(config[CONF_CONNECTION_COUNT])
-    cg.add(server.set_connection_count_sensor(sens))
+    if CONF_CONNECTION_COUNT in config:
+        sens = await sensor.new_sensor(config[CONF_CONNECTION_COUNT])
+        cg.add(server.set_connection_count_sensor(sens))
+    # Published by the memory governor, when the pressure changes.
+    if CONF_MEMORY_PRESSURE in config:
+        sens = await sensor.new_sensor(config[CONF_MEMORY_PRESSURE])
+        cg.add(server.set_memory_pressure_sensor(sens))
+    for key in DIAGNOSTICS:
+        if key in config:
+            sens = await sensor.new_sensor(config[key])
+            cg.add(getattr(server, f"set_{key}_sensor")(sens))
+    # The diagnostics are sampled and published periodically.
+    if any(key in config for key in DIAGNOSTICS):
+        cg.add(server.set_diagnostics_interval(config[CONF_UPDATE_INTERVAL]))
@@ -1,5 +1,6 @@
 #include "stream_server.h"
 
+#include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
 #include "esphome/core/log.h"
 #include "esphome/core/util.h"
@@ -9,6 +10,21 @@
 #include "esphome/components/socket/socket.h"
 
 #include "esphome/core/log.h"  // Ensure you include the logging header
+#ifdef USE_ESP32
+#include <esp_heap_caps.h>
+#endif
+#ifdef USE_ESP8266
+#include <Esp.h>
+#endif
+#ifdef USE_HOST
+#include <arpa/inet.h>
+#include <netdb.h>
+#else
+#include <lwip/dns.h>
+#endif
+#include <cmath>
+#include <cstring>
+#include <new>
 #include <sstream>
 #include <iomanip>
 
@@ -17,11 +33,72 @@ static const char *TAG = "stream_server";
 
 using namespace esphome;
 
+StreamServerComponent *StreamServerComponent::binlog_server_{nullptr};
+std::vector<StreamServerComponent *> StreamServerComponent::instances_{};
+bool StreamServerComponent::metrics_enabled_{false};
+
 void StreamServerComponent::setup() {
     ESP_LOGCONFIG(TAG, "Setting up stream server...");
 
     // The make_unique() wrapper doesn't like arrays, so initialize the unique_ptr directly.
     this->buf = std::unique_ptr<uint8_t[]>{new uint8_t[this->buf_size_]};  // Change 'buf_' to 'buf'
+    if (this->frames_size_ > 0)
+        this->frames_ = std::unique_ptr<Frame[]>{new Frame[this->frames_size_]};
+    if (this->protocol_slots_ > 0) {
+        this->protocol_frames_ = std::unique_ptr<ProtocolFrame[]>{new ProtocolFrame[this->protocol_slots_]};
+        for (uint8_t i = 0; i < this->protocol_slots_; i++)
+            this->protocol_frames_[i].used = false;
+        for (const HoldingRegister &reg : this->holding_registers_) {
+            if (reg.read)
+                this->set_holding_register(reg.address, reg.format, reg.read());
+        }
+    }
+    if (this->sources_count_ > 0) {
+        this->sources_ = std::unique_ptr<Source[]>{new Source[this->sources_count_]};
+        for (uint8_t i = 0; i < this->sources_count_; i++)
+            this->sources_[i] = Source{std::unique_ptr<uint8_t[]>{new uint8_t[this->source_buffer_size_]}, 0, 0, 0};
+    }
+
+    if (!this->sink_topic_.empty()) {
+        this->sink_buf_ = std::unique_ptr<uint8_t[]>{new uint8_t[this->sink_batch_size_]};
+#ifdef USE_MQTT
+        if (!this->sink_publisher_) {
+            this->sink_publisher_ = [](const std::string &topic, const uint8_t *data, size_t len) {
+                return mqtt::global_mqtt_client != nullptr && mqtt::global_mqtt_client->is_connected() &&
+                       mqtt::global_mqtt_client->publish(topic, reinterpret_cast<const char *>(data), len);
+            };
+        }
+#endif
+    }
+
+    if (this->binary_log_)
+        binlog_server_ = this;
+
+#ifdef USE_LOGGER
+    if (this->log_level_ >= 0 && logger::global_logger != nullptr) {
+#ifdef USE_ESP32
+        this->main_task_ = xTaskGetCurrentTaskHandle();
+#endif
+        logger::global_logger->add_on_log_callback([this](int level, const char *tag, const char *message) {
+            this->append_log(level, message);
+        });
+    }
+#endif
+
+    // A bridge should forward data as soon as possible, so don't let the main loop sleep.
+    if (this->bridge_)
+        this->high_freq_.start();
+
+    instances_.push_back(this);
+    if (this->metrics_ != nullptr) {
+        metrics_enabled_ = true;
+        this->metrics_->setup();
+    }
+
+    if (this->is_outbound()) {
+        this->publish_sensor();
+        return;
+    }
 
     struct sockaddr_storage bind_addr;
 #if ESPHOME_VERSION_CODE >= VERSION_CODE(2023, 4, 0)
@@ -38,22 +115,97 @@ void StreamServerComponent::setup() {
 }
 
 void StreamServerComponent::loop() {
-    this->accept();
+#ifdef USE_HOST
+    if (this->replay_ != nullptr && !this->replay_->step(*this, micros()))
+        this->replay_.reset();
+#endif
+    this->loop_start_ = micros();
+    uint32_t stage_start = this->loop_start_;
+    this->timers_.advance(millis());
+    if (this->is_outbound())
+        this->connect();
+    else
+        this->accept();
+    this->end_stage(0, stage_start);
+    // Cut-through: the data received from clients is handed to the consumers, and the data they produce in response is
+    // sent to the clients, all in the same pass.
     this->read();
-    this->flush();
+    this->end_stage(1, stage_start);
+    if (this->benchmark_rate_ > 0)
+        this->generate();
     this->write();
+    this->end_stage(2, stage_start);
+    this->flush();
+    this->end_stage(3, stage_start);
+    if (this->has_sink())
+        this->sink();
     this->cleanup();
+    if (this->metrics_ != nullptr)
+        this->metrics_->loop();
+    if (this->diagnostics_interval_ > 0)
+        this->diagnose();
+    if (this->governor_interval_ > 0)
+        this->govern();
+    if (this->benchmark_rate_ > 0) {
+        this->loop_time_ += micros() - this->loop_start_;
+        this->loop_count_++;
+    }
+    if (metrics_enabled_) {
+        this->end_stage(4, stage_start);
+        uint32_t duration = stage_start - this->loop_start_;
+        uint8_t bucket = 0;
+        while (bucket < LOOP_BUCKETS && duration > LOOP_BUCKET_US[bucket])
+            bucket++;
+        if (bucket < LOOP_BUCKETS)
+            this->loop_buckets_[bucket]++;
+        this->loop_time_total_ += duration;
+        this->loop_count_total_++;
+    }
+#ifdef USE_HOST
+    if (this->replay_ != nullptr)
+        this->replay_->record_loop(micros() - this->loop_start_);
+#endif
 }
 
 void StreamServerComponent::dump_config() {
     ESP_LOGCONFIG(TAG, "Stream Server:");
-    ESP_LOGCONFIG(TAG, "  Address: %s:%u", esphome::network::get_use_address().c_str(), this->port_);
+    if (this->is_outbound()) {
+        ESP_LOGCONFIG(TAG, "  Connecting to: %s:%u", this->outbound_address_.c_str(), this->outbound_port_);
+        ESP_LOGCONFIG(TAG, "  Backoff: %u - %u ms", this->min_backoff_, this->max_backoff_);
+    } else {
+        ESP_LOGCONFIG(TAG, "  Address: %s:%u", esphome::network::get_use_address().c_str(), this->port_);
+    }
+    if (this->bridge_)
+        ESP_LOGCONFIG(TAG, "  Bridge: YES (gaps detected: %u)", this->bridge_gaps_);
+    if (!this->priority_rules_.empty())
+        ESP_LOGCONFIG(TAG, "  Priority rules: %zu", this->priority_rules_.size());
+    if (this->protocol_slots_ > 0)
+        ESP_LOGCONFIG(TAG, "  Modbus slots: %u", this->protocol_slots_);
+    if (this->sources_count_ > 0)
+        ESP_LOGCONFIG(TAG, "  Merged sources: %u", this->sources_count_);
+    if (this->batch_size_ > 0)
+        ESP_LOGCONFIG(TAG, "  Batching: %zu bytes or %u ms", this->batch_size_, this->batch_timeout_);
+    if (this->metrics_ != nullptr)
+        ESP_LOGCONFIG(TAG, "  Metrics: port %u", this->metrics_->get_port());
 #ifdef USE_BINARY_SENSOR
     LOG_BINARY_SENSOR("  ", "Connected:", this->connected_sensor_);
 #endif
 #ifdef USE_SENSOR
     LOG_SENSOR("  ", "Connection count:", this->connection_count_sensor_);
+    LOG_SENSOR("  ", "Memory usage:", this->memory_usage_sensor_);
+    LOG_SENSOR("  ", "Heap largest block:", this->heap_largest_block_sensor_);
+    LOG_SENSOR("  ", "Heap fragmentation:", this->heap_fragmentation_sensor_);
+    LOG_SENSOR("  ", "Memory pressure:", this->memory_pressure_sensor_);
 #endif
+
+    MemoryUsage usage = this->memory_usage();
+    ESP_LOGCONFIG(TAG, "  Memory: %zu bytes (ring %zu, clients %zu, received data %zu, protocol %zu, other %zu)",
+                  usage.total(), usage.ring, usage.clients, usage.received, usage.protocol, usage.other);
+    this->sample_heap();
+    ESP_LOGCONFIG(TAG, "  Heap: %zu bytes free, largest block %zu bytes", this->heap_free_, this->heap_largest_block_);
+    if (this->governor_interval_ > 0)
+        ESP_LOGCONFIG(TAG, "  Memory watermarks: shrink %zu, refuse %zu, drop %zu bytes", this->watermarks_[0],
+                      this->watermarks_[1], this->watermarks_[2]);
 }
 
 void StreamServerComponent::on_shutdown() {
@@ -62,16 +214,176 @@ void StreamServerComponent::on_shutdown() {
 }
 
 void StreamServerComponent::publish_sensor() {
+#if defined(USE_BINARY_SENSOR) || defined(USE_SENSOR)
+    size_t count = std::count_if(this->clients_.begin(), this->clients_.end(), [](const Client &client) { return !client.connecting; });
+#endif
 #ifdef USE_BINARY_SENSOR
     if (this->connected_sensor_)
-        this->connected_sensor_->publish_state(this->clients_.size() > 0);
+        this->connected_sensor_->publish_state(count > 0);
 #endif
 #ifdef USE_SENSOR
     if (this->connection_count_sensor_)
-        this->connection_count_sensor_->publish_state(this->clients_.size());
+        this->connection_count_sensor_->publish_state(count);
 #endif
 }
 
+StreamServerComponent::MemoryUsage StreamServerComponent::memory_usage() const {
+    MemoryUsage usage{};
+    usage.ring = this->buf_size_;
+    usage.clients = this->clients_.capacity() * sizeof(Client);
+    for (const Client &client : this->clients_) {
+        usage.clients += sizeof(TimerWheel::Timer) * 2 + sizeof(ControlQueue) + client.identifier.capacity();
+        usage.clients += client.channels.capacity() * sizeof(Client::Channel);
+    }
+    usage.received = this->received_data_.capacity();
+    usage.protocol = this->protocol_slots_ * sizeof(ProtocolFrame) + this->holding_image_.memory_usage() +
+                     this->input_image_.memory_usage() + this->holding_registers_.capacity() * sizeof(HoldingRegister);
+    usage.other = this->frames_size_ * sizeof(Frame) + this->sources_count_ * (sizeof(Source) + this->source_buffer_size_);
+    if (this->sink_buf_ != nullptr)
+        usage.other += this->sink_batch_size_;
+    return usage;
+}
+
+bool StreamServerComponent::sample_heap() {
+    // Both are cheap to query: the allocator keeps the free size, and only walks the free list for the largest block.
+    // Returns false on platforms where the heap can't be sampled.
+#if defined(USE_ESP32)
+    this->heap_free_ = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    this->heap_largest_block_ = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    return true;
+#elif defined(USE_ESP8266)
+    this->heap_free_ = ESP.getFreeHeap();
+    this->heap_largest_block_ = ESP.getMaxFreeBlockSize();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void StreamServerComponent::diagnose() {
+    if (this->diagnostics_timer_.scheduled())
+        return;
+    this->timers_.schedule(&this->diagnostics_timer_, millis(), this->diagnostics_interval_);
+
+    this->sample_heap();
+#ifdef USE_SENSOR
+    if (this->memory_usage_sensor_)
+        this->memory_usage_sensor_->publish_state(this->memory_usage().total());
+    if (this->heap_largest_block_sensor_)
+        this->heap_largest_block_sensor_->publish_state(this->heap_largest_block_);
+    // Fragmentation is the share of free memory that isn't in the largest block.
+    if (this->heap_fragmentation_sensor_ && this->heap_free_ > 0)
+        this->heap_fragmentation_sensor_->publish_state(100.0f - 100.0f * this->heap_largest_block_ / this->heap_free_);
+#endif
+
+    uint32_t now = millis();
+    if (this->benchmark_rate_ > 0 && this->diagnosed_ != 0) {
+        // Rates over the interval since the previous report.
+        float seconds = (now - this->diagnosed_) / 1000.0f;
+        uint32_t generated = this->benchmark_sequence_ - this->benchmark_reported_;
+        uint32_t dropped = this->benchmark_dropped_ - this->benchmark_dropped_reported_;
+        float throughput = (this->bytes_written_ - this->bytes_written_reported_) / seconds;
+        float loop_time = this->loop_count_ > 0 ? float(this->loop_time_) / this->loop_count_ : 0.0f;
+        float drop_rate = generated + dropped > 0 ? 100.0f * dropped / (generated + dropped) : 0.0f;
+        ESP_LOGD(TAG, "Benchmark: %.0f B/s to clients, %.1f us per loop, %.2f%% dropped", throughput, loop_time, drop_rate);
+#ifdef USE_SENSOR
+        if (this->benchmark_throughput_sensor_)
+            this->benchmark_throughput_sensor_->publish_state(throughput);
+        if (this->benchmark_loop_time_sensor_)
+            this->benchmark_loop_time_sensor_->publish_state(loop_time);
+        if (this->benchmark_drop_rate_sensor_)
+            this->benchmark_drop_rate_sensor_->publish_state(drop_rate);
+#endif
+    }
+    this->benchmark_reported_ = this->benchmark_sequence_;
+    this->benchmark_dropped_reported_ = this->benchmark_dropped_;
+    this->bytes_written_reported_ = this->bytes_written_;
+    this->loop_time_ = 0;
+    this->loop_count_ = 0;
+    this->diagnosed_ = now;
+}
+
+void StreamServerComponent::generate() {
+    // The credit grows with the rate, and is spent in whole records. What doesn't fit in the ring is counted as dropped,
+    // instead of overwriting pending data.
+    uint32_t now = micros();
+    if (this->benchmark_last_ != 0)
+        this->benchmark_credit_ += uint64_t(this->benchmark_rate_) * (now - this->benchmark_last_);
+    this->benchmark_last_ = now;
+    this->benchmark_credit_ = std::min<uint64_t>(this->benchmark_credit_, uint64_t(this->buf_size_) * 1000000);
+
+    while (this->benchmark_credit_ >= BENCHMARK_RECORD_SIZE * 1000000) {
+        this->benchmark_credit_ -= BENCHMARK_RECORD_SIZE * 1000000;
+        if (this->buf_size_ - (this->buf_head_ - this->buf_tail_) < BENCHMARK_RECORD_SIZE) {
+            this->benchmark_dropped_++;
+            continue;
+        }
+
+        uint32_t sequence = this->benchmark_sequence_++;
+        uint8_t record[BENCHMARK_RECORD_SIZE] = {'B', 'M'};
+        binlog_put_u32(&record[2], sequence);
+        binlog_put_u32(&record[6], now);
+        for (size_t i = 10; i < BENCHMARK_RECORD_SIZE; i++)
+            record[i] = (sequence + i) * 0x9D;
+        this->publish(record, sizeof(record));
+    }
+}
+
+void StreamServerComponent::govern() {
+    if (this->governor_timer_.scheduled())
+        return;
+    this->timers_.schedule(&this->governor_timer_, millis(), this->governor_interval_);
+
+    if (!this->sample_heap())
+        return;
+    // The level is that of the lowest watermark above the largest block. A level is left again only once the largest
+    // block has grown by a quarter above its watermark, so it doesn't flap around a watermark.
+    size_t block = this->heap_largest_block_;
+    uint8_t level = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        if (block < this->watermarks_[i])
+            level = i + 1;
+    }
+    for (uint8_t i = (uint8_t) this->pressure_; i > level; i--) {
+        if (block < this->watermarks_[i - 1] + this->watermarks_[i - 1] / 4) {
+            level = i;
+            break;
+        }
+    }
+    MemoryPressure pressure = static_cast<MemoryPressure>(level);
+
+    if (pressure != this->pressure_) {
+        ESP_LOGW(TAG, "Memory pressure changed from %u to %u, largest free block %zu bytes", (unsigned) this->pressure_,
+                 (unsigned) pressure, block);
+    }
+#ifdef USE_SENSOR
+    if (this->memory_pressure_sensor_ && (pressure != this->pressure_ || !this->memory_pressure_sensor_->has_state()))
+        this->memory_pressure_sensor_->publish_state((uint8_t) pressure);
+#endif
+    this->pressure_ = pressure;
+
+    // The ring is the largest buffer. It's halved on every pass under pressure, as long as the retained data fits, and
+    // restored once the pressure is gone. The smaller ring is allocated before the larger one is freed, which is what
+    // the watermark leaves room for.
+    if (pressure == MemoryPressure::NORMAL) {
+        if (this->buf_size_ < this->ring_size_)
+            this->reallocate(this->ring_size_);
+        return;
+    }
+    size_t smaller = this->buf_size_ / 2;
+    if (smaller >= std::max(MIN_RING_SIZE, this->ring_size_ / 4) && this->buf_head_ - this->buf_tail_ <= smaller)
+        this->reallocate(smaller);
+
+    if (pressure >= MemoryPressure::DROP) {
+        for (Client &client : this->clients_) {
+            if (client.priority == ClientPriority::BEST_EFFORT && !client.disconnected) {
+                ESP_LOGW(TAG, "Dropping best-effort client %s, memory is low", client.identifier.c_str());
+                client.disconnected = true;
+            }
+        }
+    }
+}
+
 void StreamServerComponent::accept() {
     struct sockaddr_storage client_addr;
     socklen_t client_addrlen = sizeof(client_addr);
@@ -81,50 +393,360 @@ void StreamServerComponent::accept() {
 
     socket->setblocking(false);
     std::string identifier = socket->getpeername();
+    if (this->pressure_ >= MemoryPressure::REFUSE) {
+        // Closed right away, so the client doesn't wait in the backlog.
+        ESP_LOGW(TAG, "Refusing client %s, memory is low", identifier.c_str());
+        return;
+    }
+    this->add_client(std::move(socket), identifier, this->classify(reinterpret_cast<struct sockaddr *>(&client_addr)));
+}
+
+void StreamServerComponent::add_client(std::unique_ptr<socket::Socket> socket, const std::string &identifier,
+                                       ClientPriority priority) {
+    if (this->bridge_) {
+        // There is only one peer, so a new connection replaces a previous one that might be half-open.
+        for (Client &client : this->clients_) {
+            if (client.outbound && !client.disconnected) {
+                ESP_LOGW(TAG, "Replacing bridge connection from %s", client.identifier.c_str());
+                client.disconnected = true;
+                this->outbound_position_ = client.position;
+            }
+        }
+    }
+
     this->clients_.emplace_back(std::move(socket), identifier, this->buf_head_);
+    this->init_client(this->clients_.back());
+    this->clients_.back().priority = priority;
+    this->clients_.back().changes_only = this->changes_only_ && this->frames_size_ > 0;
+    if (this->protocol_slots_ > 0) {
+        // Protocol handler frames are preallocated, so the number of protocol clients is limited.
+        Client &client = this->clients_.back();
+        for (uint8_t i = 0; i < this->protocol_slots_ && client.slot < 0; i++) {
+            if (!this->protocol_frames_[i].used) {
+                client.slot = i;
+                this->protocol_frames_[i].used = true;
+                this->protocol_frames_[i].resume = 0;
+                this->protocol_frames_[i].backlog_len = 0;
+            }
+        }
+        if (client.slot < 0) {
+            ESP_LOGW(TAG, "No protocol slot available, rejecting client %s", client.identifier.c_str());
+            client.disconnected = true;
+        }
+    }
+    if (this->bridge_)
+        this->start_peer(this->clients_.back());
     ESP_LOGD(TAG, "New client connected from %s", identifier.c_str());
+    binlog(BinlogId::CONNECT, this->clients_.back().number, this->port_);
+    this->client_connected_callback_.call(this->clients_.back().number, identifier);
     this->publish_sensor();
 }
 
+void StreamServerComponent::connect() {
+    uint32_t now = millis();
+    for (Client &client : this->clients_) {
+        if (!client.outbound || !client.connecting || client.disconnected)
+            continue;
+
+        // A non-blocking connect() has completed once the peer address is known.
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addrlen = sizeof(peer_addr);
+        client.socket->getsockopt(SOL_SOCKET, SO_ERROR, &error, &error_len);
+        if (error == 0 && client.socket->getpeername(reinterpret_cast<struct sockaddr *>(&peer_addr), &peer_addrlen) == 0) {
+            client.connecting = false;
+            client.deadline->cancel();
+            ESP_LOGD(TAG, "Connected to %s, resuming at offset %zu", client.identifier.c_str(), client.position);
+            this->start_peer(client);
+            binlog(BinlogId::CONNECT, client.number, this->port_);
+            this->client_connected_callback_.call(client.number, client.identifier);
+            this->publish_sensor();
+        } else if (error != 0 || client.deadline->expired) {
+            ESP_LOGW(TAG, "Failed to connect to %s with error %d", client.identifier.c_str(), error);
+            client.disconnected = true;
+        }
+    }
+
+    if (!this->clients_.empty() || this->connect_timer_.scheduled() || !this->resolve())
+        return;
+
+    struct sockaddr_storage addr;
+#if ESPHOME_VERSION_CODE >= VERSION_CODE(2023, 4, 0)
+    socklen_t addrlen = socket::set_sockaddr(reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr), this->outbound_ip_, this->outbound_port_);
+#else
+    socklen_t addrlen = socket::set_sockaddr(reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr), this->outbound_ip_, htons(this->outbound_port_));
+#endif
+
+    std::unique_ptr<socket::Socket> socket = socket::socket_ip(SOCK_STREAM, PF_INET);
+    if (!socket || addrlen == 0) {
+        this->schedule_connect();
+        return;
+    }
+    socket->setblocking(false);
+    if (socket->connect(reinterpret_cast<struct sockaddr *>(&addr), addrlen) != 0 && errno != EINPROGRESS) {
+        ESP_LOGW(TAG, "Failed to connect to %s:%u with error %d", this->outbound_address_.c_str(), this->outbound_port_, errno);
+        this->schedule_connect();
+        return;
+    }
+
+    // Resume where the previous connection left off; discard() keeps the offset within the ring.
+    std::string identifier = this->outbound_address_ + ":" + std::to_string(this->outbound_port_);
+    this->clients_.emplace_back(std::move(socket), identifier, this->outbound_position_);
+    Client &client = this->clients_.back();
+    this->init_client(client);
+    client.outbound = true;
+    client.connecting = true;
+    this->timers_.schedule(client.deadline.get(), now, 10000);
+}
+
+bool StreamServerComponent::resolve() {
+    // Returns whether the address of the collector is known. A lookup that has to go to the network doesn't block the
+    // loop: connect() is retried until it completes. The name is looked up again for every connection attempt, so a
+    // collector that moves is found (lookups are cached by the network stack).
+    switch (this->dns_state_.load(std::memory_order_acquire)) {
+        case DnsState::PENDING:
+            return false;
+        case DnsState::RESOLVED:
+            this->dns_state_.store(DnsState::IDLE, std::memory_order_relaxed);
+            return true;
+        case DnsState::FAILED:
+            this->dns_state_.store(DnsState::IDLE, std::memory_order_relaxed);
+            ESP_LOGW(TAG, "Failed to resolve %s", this->outbound_address_.c_str());
+            this->schedule_connect();
+            return false;
+        case DnsState::IDLE:
+            break;
+    }
+
+#ifdef USE_HOST
+    struct addrinfo hints {};
+    struct addrinfo *result = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(this->outbound_address_.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) {
+        ESP_LOGW(TAG, "Failed to resolve %s", this->outbound_address_.c_str());
+        this->schedule_connect();
+        return false;
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(result->ai_addr)->sin_addr, ip, sizeof(ip));
+    freeaddrinfo(result);
+    this->outbound_ip_ = ip;
+    return true;
+#else
+    ip_addr_t addr;
+    this->dns_state_.store(DnsState::PENDING, std::memory_order_relaxed);
+    err_t err = dns_gethostbyname(this->outbound_address_.c_str(), &addr, &StreamServerComponent::dns_found, this);
+    if (err == ERR_INPROGRESS)
+        return false;
+    // Answered right away, from an IP address or the cache, or failed.
+    dns_found(this->outbound_address_.c_str(), err == ERR_OK ? &addr : nullptr, this);
+    return this->resolve();
+#endif
+}
+
+#ifndef USE_HOST
+void StreamServerComponent::dns_found(const char *name, const ip_addr_t *addr, void *arg) {
+    auto *server = static_cast<StreamServerComponent *>(arg);
+    if (addr != nullptr) {
+        char ip[IPADDR_STRLEN_MAX];
+        ipaddr_ntoa_r(addr, ip, sizeof(ip));
+        server->outbound_ip_ = ip;
+    }
+    server->dns_state_.store(addr != nullptr ? DnsState::RESOLVED : DnsState::FAILED, std::memory_order_release);
+}
+#endif
+
+void StreamServerComponent::schedule_connect() {
+    // Exponential backoff with jitter, so a fleet of devices doesn't reconnect to the collector in lockstep.
+    uint32_t backoff = this->min_backoff_;
+    for (uint8_t i = 0; i < this->connect_attempts_ && backoff < this->max_backoff_; i++)
+        backoff *= 2;
+    backoff = std::min(backoff, this->max_backoff_);
+    backoff = backoff / 2 + random_uint32() % (backoff / 2 + 1);
+    if (this->connect_attempts_ < UINT8_MAX)
+        this->connect_attempts_++;
+
+    this->timers_.schedule(&this->connect_timer_, millis(), backoff);
+    ESP_LOGD(TAG, "Reconnecting to %s:%u in %u ms", this->outbound_address_.c_str(), this->outbound_port_, backoff);
+}
+
+void StreamServerComponent::start_peer(Client &client) {
+    client.outbound = true;
+    client.position = this->outbound_position_;
+    if (!this->bridge_)
+        return;
+
+    int enable = 1;
+    client.socket->setsockopt(IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    // Tell the peer how much of its stream we've received, and hold back our data until we know the same of the peer.
+    const uint8_t hello[] = {BRIDGE_HELLO, 1, uint8_t(this->peer_offset_ >> 24), uint8_t(this->peer_offset_ >> 16),
+                             uint8_t(this->peer_offset_ >> 8), uint8_t(this->peer_offset_)};
+    client.control->push(hello, sizeof(hello));
+    client.handshaking = true;
+    client.handshake_len = 0;
+}
+
+size_t StreamServerComponent::handshake(Client &client, const uint8_t *data, size_t len) {
+    // The handshake consists of a hello with the offset in our stream that the peer has received, followed by a sync
+    // with the offset in the peer's stream at which its data starts. Both are six bytes.
+    size_t consumed = 0;
+    while (client.handshaking && consumed < len) {
+        client.handshake[client.handshake_len++] = data[consumed++];
+        if (client.handshake_len < sizeof(client.handshake))
+            continue;
+
+        client.handshake_len = 0;
+        uint32_t offset = (uint32_t(client.handshake[2]) << 24) | (uint32_t(client.handshake[3]) << 16) |
+                          (uint32_t(client.handshake[4]) << 8) | client.handshake[5];
+        if (client.handshake[0] == BRIDGE_HELLO) {
+            // Resume from where the peer is, if that data is still in the ring.
+            uint32_t tail = this->buf_tail_, head = this->buf_head_;
+            if (offset - tail <= head - tail) {
+                client.position = this->buf_tail_ + (offset - tail);
+            } else {
+                ESP_LOGW(TAG, "Bridge peer %s is at offset %u, outside of the buffered %u - %u", client.identifier.c_str(), offset, tail, head);
+                client.position = this->buf_tail_;
+            }
+            uint32_t position = client.position;
+            const uint8_t sync[] = {BRIDGE_SYNC, 1, uint8_t(position >> 24), uint8_t(position >> 16),
+                                    uint8_t(position >> 8), uint8_t(position)};
+            client.control->push(sync, sizeof(sync));
+        } else if (client.handshake[0] == BRIDGE_SYNC) {
+            if (offset != this->peer_offset_) {
+                ESP_LOGW(TAG, "Gap in bridge stream from %s: expected offset %u, got %u", client.identifier.c_str(), this->peer_offset_, offset);
+                this->bridge_gaps_++;
+                this->peer_offset_ = offset;
+            }
+            client.handshaking = false;
+            ESP_LOGD(TAG, "Bridge to %s established at offsets %zu/%u", client.identifier.c_str(), client.position, offset);
+        } else {
+            ESP_LOGE(TAG, "Invalid bridge handshake from %s", client.identifier.c_str());
+            client.disconnected = true;
+            return len;
+        }
+    }
+    return consumed;
+}
+
+ClientPriority StreamServerComponent::classify(const struct sockaddr *addr) {
+    if (addr->sa_family != AF_INET)
+        return this->default_priority_;
+
+    uint32_t ip = ntohl(reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr.s_addr);
+    for (const PriorityRule &rule : this->priority_rules_) {
+        if ((ip & rule.mask) == rule.network)
+            return rule.priority;
+    }
+    return this->default_priority_;
+}
+
 void StreamServerComponent::cleanup() {
     auto discriminator = [](const Client &client) { return !client.disconnected; };
     auto last_client = std::partition(this->clients_.begin(), this->clients_.end(), discriminator);
     if (last_client != this->clients_.end()) {
+        for (auto it = last_client; it != this->clients_.end(); ++it) {
+            if (it->slot >= 0)
+                this->protocol_frames_[it->slot].used = false;
+            if (it->outbound) {
+                this->outbound_position_ = it->position;
+                if (this->is_outbound())
+                    this->schedule_connect();
+            }
+            if (!it->connecting) {
+                binlog(BinlogId::DISCONNECT, it->number, this->port_);
+                this->client_disconnected_callback_.call(it->number, it->identifier);
+            }
+        }
         this->clients_.erase(last_client, this->clients_.end());
         this->publish_sensor();
     }
 }
 
 void StreamServerComponent::read() {
-    size_t len = 0;
-    uint8_t buf[128];  // Declare a buffer to hold data
     ssize_t read;
 
     for (Client &client : this->clients_) {
-        if (client.disconnected)
+        if (client.disconnected || client.connecting)
+            continue;
+
+        if (client.slot >= 0 && this->protocol_frames_[client.slot].backlog_len > 0) {
+            // The protocol handler is waiting for room for a response. Don't read more until it has caught up, so a
+            // client that keeps sending requests is held back by TCP flow control.
+            ProtocolFrame &frame = this->protocol_frames_[client.slot];
+            const uint8_t *data = frame.backlog;
+            size_t len = frame.backlog_len;
+            this->run_modbus(client, frame, data, len);
+            std::memmove(frame.backlog, data, len);
+            frame.backlog_len = len;
             continue;
+        }
+
+        // A protocol client is read once per pass, no more than fits in the backlog of its frame, so what the handler
+        // leaves over can be kept there.
+        size_t chunk = client.slot >= 0 ? sizeof(ProtocolFrame::backlog) : 128;
+        size_t start = this->received_data_.size();
+        while (true) {
+            // Read straight into the received data buffer, so it can be handed to the consumers without another copy.
+            size_t offset = this->received_data_.size();
+            this->received_data_.resize(offset + chunk);
+            read = client.socket->read(&this->received_data_[offset], chunk);
+            this->received_data_.resize(offset + std::max<ssize_t>(read, 0));
+            if (read <= 0)
+                break;
 
-        while ((read = client.socket->read(buf, sizeof(buf))) > 0) {
-            // Log buffer data size first
-            ESP_LOGD(TAG, "Buffer data (size: %d):", read);
+            this->bytes_read_ += read;
+            if (client.outbound)
+                this->connect_attempts_ = 0;
+            binlog(BinlogId::READ, read, this->port_, client.number);
 
+#if ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_VERY_VERBOSE
             // Build a hex string of the data
             std::stringstream hex_data;
             for (size_t i = 0; i < read; ++i) {
-                hex_data << std::hex << std::setw(2) << std::setfill('0') << (int)buf[i] << " ";
+                hex_data << std::hex << std::setw(2) << std::setfill('0') << (int)this->received_data_[offset + i] << " ";
             }
 
             // Log all the bytes in one message
-            ESP_LOGD(TAG, "%s", hex_data.str().c_str());
+            ESP_LOGVV(TAG, "Buffer data (size: %d): %s", read, hex_data.str().c_str());
+#endif
+            if (client.slot >= 0)
+                break;
+        }
 
-            // Optionally, insert into received data
-            this->received_data_.insert(this->received_data_.end(), buf, buf + read);
+        if (client.outbound && this->bridge_ && this->received_data_.size() > start) {
+            size_t consumed = this->handshake(client, &this->received_data_[start], this->received_data_.size() - start);
+            this->received_data_.erase(this->received_data_.begin() + start, this->received_data_.begin() + start + consumed);
+            this->peer_offset_ += this->received_data_.size() - start;
+        }
 
-            // Pass the data to the Modbus parser
-            //this->parse_modbus_request(buf, read);
+        if (this->has_urgent_ && this->received_data_.size() > start) {
+            size_t len = this->extract_urgent(client, &this->received_data_[start], this->received_data_.size() - start);
+            this->received_data_.resize(start + len);
         }
 
-        if (read == 0 || errno == ECONNRESET) {
+        if (client.slot >= 0) {
+            // Requests are answered by the protocol handler, resumed with the data received in this pass.
+            const uint8_t *data = this->received_data_.data() + start;
+            size_t len = this->received_data_.size() - start;
+            ProtocolFrame &frame = this->protocol_frames_[client.slot];
+            this->run_modbus(client, frame, data, len);
+            std::memcpy(frame.backlog, data, len);
+            frame.backlog_len = len;
+            this->received_data_.resize(start);
+        } else if (!this->channels_.empty()) {
+            // Multiplexed data is passed on to the channels, not to the consumers of this server.
+            this->demux(client, &this->received_data_[start], this->received_data_.size() - start);
+            this->received_data_.resize(start);
+        } else if (this->received_data_.size() > start)
+            this->client_view_callback_.call(client.number,
+                                             StreamView{&this->received_data_[start], this->received_data_.size() - start});
+
+        if (read > 0) {
+            // Stopped early for a protocol client, the rest is read in the next pass.
+        } else if (read == 0 || errno == ECONNRESET) {
             ESP_LOGD(TAG, "Client %s disconnected", client.identifier.c_str());
             client.disconnected = true;
         } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
@@ -136,83 +758,909 @@ void StreamServerComponent::read() {
 }
 
 void StreamServerComponent::flush() {
+    uint32_t now = millis();
+
+    // Clients are flushed in order of priority. Best-effort clients are skipped when this pass has run out of time.
+    for (ClientPriority priority : {ClientPriority::PRIMARY, ClientPriority::NORMAL, ClientPriority::BEST_EFFORT}) {
+        for (Client &client : this->clients_) {
+            if (client.priority != priority)
+                continue;
+            if (priority == ClientPriority::BEST_EFFORT && this->flush_budget_ > 0 &&
+                micros() - this->loop_start_ > this->flush_budget_)
+                break;
+            this->flush_client(client, now);
+        }
+    }
+
+    // The peer connection holds on to its data while it is reconnecting, and the sink while the broker is unavailable.
+    this->buf_tail_ = this->has_peer() ? this->outbound_position_ : this->buf_head_;
+    if (this->has_sink())
+        this->buf_tail_ = std::min(this->buf_tail_, this->sink_position_);
+    for (const Client &client : this->clients_) {
+        if (!client.disconnected && client.priority != ClientPriority::BEST_EFFORT)
+            this->buf_tail_ = std::min(this->buf_tail_, client.position);
+    }
+    if (this->mux_ != nullptr)
+        this->buf_tail_ = this->mux_->channel_tail(this->channel_, this->buf_tail_);
+}
+
+void StreamServerComponent::flush_client(Client &client, uint32_t now) {
     ssize_t written;
-    this->buf_tail_ = this->buf_head_;
+    if (client.disconnected || client.connecting)
+        return;
+    if (!this->channels_.empty()) {
+        this->flush_channels(client);
+        return;
+    }
+
+    // Queued messages are sent ahead of the ring data, in the same call. During the handshake only those are sent.
+    struct iovec iov[ControlQueue::SLOTS + 2];
+    int count = client.control->fill(iov);
+    if (this->buf_head_ - client.position > this->buf_size_) {
+        // Best-effort clients don't hold back the tail, so the data they hadn't received yet may have been overwritten.
+        this->bytes_dropped_ += this->buf_head_ - this->buf_size_ - client.position;
+        binlog(BinlogId::DROP, this->buf_head_ - this->buf_size_ - client.position, this->port_);
+        client.position = this->buf_head_ - this->buf_size_;
+    }
+
+    size_t end = client.changes_only ? this->select_changes(client, now) : this->buf_head_;
+    size_t pending = client.handshaking ? 0 : end - client.position;
+    bool batching = client.congested && pending < this->batch_size_ && client.deadline->scheduled();
+    if (count == 0 && (pending == 0 || batching))
+        return;
+
+    // Offer no more than fits in the send buffer, in whole segments, and leave the remainder for the next pass. Offering
+    // more only results in a partial write that ends in a short segment. When all pending data fits, or for a bridge
+    // that must not delay its data, the tail is sent as well.
+    size_t offered = 0;
+    for (int i = 0; i < count; i++)
+        offered += iov[i].iov_len;
+    size_t limit = std::max(client.send_space, SEGMENT_SIZE);
+    size_t offer = std::min(pending, limit > offered ? limit - offered : 0);
+    if (offer < pending && !this->bridge_) {
+        if (offer >= SEGMENT_SIZE)
+            offer -= (offered + offer) % SEGMENT_SIZE;
+        else if (pending >= SEGMENT_SIZE && count > 0)
+            offer = 0;
+    }
+    if (offer > 0) {
+        iov[count].iov_base = &this->buf[this->buf_index(client.position)];  // Change 'buf_' to 'buf'
+        iov[count].iov_len = std::min(offer, this->buf_ahead(client.position));
+        iov[count + 1].iov_base = &this->buf[0];  // Change 'buf_' to 'buf'
+        iov[count + 1].iov_len = offer - iov[count].iov_len;
+        count += 2;
+        offered += offer;
+    }
+    if (count == 0)
+        return;
+    ssize_t taken = written = client.socket->writev(iov, count);  // Including the queued messages
+    if (written > 0) {
+        this->bytes_written_ += written;
+        if (this != binlog_server_)
+            binlog(BinlogId::WRITE, written, this->port_, client.number);
+        written -= client.control->consume(written);
+        if (client.changes_only)
+            this->record_changes(client, client.position, client.position + written);
+        client.position += written;
+        if (client.outbound) {
+            this->outbound_position_ = client.position;
+            // The backoff only starts over once the collector takes data, not when it accepts and then hangs up.
+            if (written > 0)
+                this->connect_attempts_ = 0;
+        }
+    } else if (written == 0 || errno == ECONNRESET) {
+        ESP_LOGD(TAG, "Client %s disconnected", client.identifier.c_str());
+        client.disconnected = true;
+        return;
+    } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
+        // Expected if the (TCP) transmit buffer is full, nothing to do.
+    } else {
+        ESP_LOGE(TAG, "Failed to write to client %s with error %d!", client.identifier.c_str(), errno);
+    }
+
+    // The send space is estimated from the result: a partial write filled the send buffer, so that's what it can take in
+    // a pass; after a complete write it may take more. When nothing was taken, a single segment is offered next time.
+    if (taken < (ssize_t) offered)
+        client.send_space = taken > 0 ? taken : 0;
+    else
+        client.send_space = std::min(client.send_space + SEGMENT_SIZE, MAX_SEND_SPACE);
+
+    // If the link can't keep up, start batching writes instead of sending many small segments.
+    client.congested = this->batch_size_ > 0 && taken < (ssize_t) offered;
+    if (client.congested)
+        this->timers_.schedule(client.deadline.get(), now, this->batch_timeout_);
+}
+
+size_t StreamServerComponent::select_changes(Client &client, uint32_t now) {
+    if (this->keyframe_interval_ > 0 && !client.keyframe->scheduled()) {
+        client.hashes_valid = 0;
+        this->timers_.schedule(client.keyframe.get(), now, this->keyframe_interval_);
+    }
+
+    // Select the run of changed frames that starts at the position of the client, skipping the unchanged frames in front
+    // of it. Positions are compared by their distance to the head, as they wrap around. Each frame is compared with the
+    // previous frame of its type, which may be earlier in the same run, so a burst of repeats ends the run.
+    uint32_t hashes[16];
+    std::memcpy(hashes, client.hashes, sizeof(hashes));
+    uint16_t hashes_valid = client.hashes_valid;
+    size_t head = this->buf_head_, end = client.position;
+    size_t oldest = this->frames_count_ > this->frames_size_ ? this->frames_count_ - this->frames_size_ : 0;
+    for (size_t i = oldest; i < this->frames_count_; i++) {
+        const Frame &frame = this->frames_[i % this->frames_size_];
+        size_t frame_end = frame.position + frame.length;
+        if (head - frame_end >= head - client.position)
+            continue;  // Already sent
+        if (head - frame.position > head - client.position) {
+            end = frame_end;  // Partially sent, send the remainder
+            continue;
+        }
+        if (frame.position != end) {
+            // Data from before the oldest frame in the index is sent as-is.
+            if (end == client.position)
+                end = frame.position;
+            break;
+        }
+
+        bool unchanged = (hashes_valid & (1 << frame.type)) && hashes[frame.type] == frame.hash;
+        if (unchanged && end == client.position)
+            client.position = end = frame_end;
+        else if (unchanged)
+            break;
+        else
+            end = frame_end;
+        hashes[frame.type] = frame.hash;
+        hashes_valid |= 1 << frame.type;
+    }
+    return end;
+}
+
+void StreamServerComponent::record_changes(Client &client, size_t from, size_t to) {
+    size_t head = this->buf_head_;
+    size_t oldest = this->frames_count_ > this->frames_size_ ? this->frames_count_ - this->frames_size_ : 0;
+    for (size_t i = oldest; i < this->frames_count_; i++) {
+        const Frame &frame = this->frames_[i % this->frames_size_];
+        if (head - frame.position <= head - from && head - frame.position > head - to) {
+            client.hashes[frame.type] = frame.hash;
+            client.hashes_valid |= 1 << frame.type;
+        }
+    }
+}
+
+void StreamServerComponent::sink() {
+    size_t pending = this->buf_head_ - this->sink_position_;
+    if (pending == 0)
+        return;
+
+    // Collect data until a message is full, or the interval since the first pending byte has passed.
+    uint32_t now = millis();
+    if (!this->sink_waiting_) {
+        this->sink_waiting_ = true;
+        this->timers_.schedule(&this->sink_timer_, now, this->sink_interval_);
+    }
+    if (pending < this->sink_batch_size_ && this->sink_timer_.scheduled())
+        return;
+
+    size_t len = std::min(pending, this->sink_batch_size_);
+    if (this->sink_by_frame_)
+        len = this->frame_boundary(this->sink_position_, len);
+    if (len == 0)
+        return;
+
+    size_t first = std::min(len, this->buf_ahead(this->sink_position_));
+    std::memcpy(&this->sink_buf_[0], &this->buf[this->buf_index(this->sink_position_)], first);
+    std::memcpy(&this->sink_buf_[first], &this->buf[0], len - first);
+    if (!this->sink_publisher_(this->sink_topic_, this->sink_buf_.get(), len))
+        return;
+
+    this->sink_position_ += len;
+    this->sink_waiting_ = false;
+}
+
+size_t StreamServerComponent::frame_boundary(size_t from, size_t max) {
+    // Find the end of the last whole frame within max bytes of from. If the first frame doesn't fit in max bytes, split
+    // it; the data of the frame that is still being written is never included.
+    size_t head = this->buf_head_, end = from;
+    size_t oldest = this->frames_count_ > this->frames_size_ ? this->frames_count_ - this->frames_size_ : 0;
+    for (size_t i = oldest; i < this->frames_count_; i++) {
+        const Frame &frame = this->frames_[i % this->frames_size_];
+        size_t frame_end = frame.position + frame.length;
+        if (head - frame_end >= head - from)
+            continue;
+        if (frame_end - from > max)
+            return end == from ? max : end - from;
+        end = frame_end;
+    }
+    return end - from;
+}
+
+void StreamServerComponent::write() {
+    if (this->sources_count_ > 0)
+        this->merge();
+
+    // There is no UART stream anymore, so hand the data received from clients to the consumers registered through
+    // add_on_client_data_callback() instead. Data sources append to the ring through publish() or prepare()/commit().
+    if (this->received_data_.empty())
+        return;
+
+    this->client_data_callback_.call(this->received_data_.data(), this->received_data_.size());
+    this->received_data_.clear();
+}
+
+size_t StreamServerComponent::publish(const uint8_t *data, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        size_t free;
+        uint8_t *dst = this->prepare(&free);
+        if (free == 0) {
+            this->discard(len - total);
+            continue;
+        }
+
+        free = std::min(free, len - total);
+        std::memcpy(dst, data + total, free);
+        this->commit(free);
+        total += free;
+    }
+    return total;
+}
+
+void StreamServerComponent::append_log(int level, const char *message) {
+    // This is called from within the logger, so it must not log itself, and must not drop data of the clients.
+    if (level > this->log_level_)
+        return;
+#ifdef USE_ESP32
+    // Lines logged by other tasks would race with the loop over the ring, so they are counted as dropped.
+    if (xTaskGetCurrentTaskHandle() != this->main_task_) {
+        this->log_dropped_++;
+        return;
+    }
+#endif
+
+    char note[48];
+    size_t note_len = 0;
+    uint32_t dropped = this->log_dropped_.load();
+    if (dropped != this->log_dropped_reported_) {
+        note_len = snprintf(note, sizeof(note), "[%u log lines dropped]\n", dropped - this->log_dropped_reported_);
+        note_len = std::min(note_len, sizeof(note) - 1);
+    }
+
+    size_t len = strlen(message);
+    size_t free = this->buf_size_ - (this->buf_head_ - this->buf_tail_);
+    if (note_len + len + 1 > free) {
+        this->log_dropped_++;
+        return;
+    }
+
+    if (note_len > 0) {
+        this->publish(reinterpret_cast<const uint8_t *>(note), note_len);
+        this->log_dropped_reported_ = dropped;
+    }
+    this->publish(reinterpret_cast<const uint8_t *>(message), len);
+    this->publish(reinterpret_cast<const uint8_t *>("\n"), 1);
+}
+
+void StreamServerComponent::append_binlog(const uint8_t *record, size_t len) {
+    // Like append_log(), this must never log or block. Dropped records are reported with a record of their own.
+    size_t free = this->buf_size_ - (this->buf_head_ - this->buf_tail_);
+    size_t dropped_len = this->binlog_dropped_ > 0 ? BINLOG_HEADER_SIZE + 4 : 0;
+    if (dropped_len + len > free) {
+        this->binlog_dropped_++;
+        return;
+    }
+
+    if (dropped_len > 0) {
+        uint8_t dropped[BINLOG_HEADER_SIZE + 4];
+        dropped[0] = static_cast<uint8_t>(BinlogId::DROPPED);
+        binlog_put_u32(&dropped[1], micros());
+        binlog_put_u32(&dropped[BINLOG_HEADER_SIZE], this->binlog_dropped_);
+        this->publish(dropped, sizeof(dropped));
+        this->binlog_dropped_ = 0;
+    }
+    this->publish(record, len);
+}
+
+size_t StreamServerComponent::publish(uint8_t source, const uint8_t *data, size_t len) {
+    if (source >= this->sources_count_)
+        return 0;
+
+    // Stage the data until the next merge, dropping what doesn't fit.
+    Source &staging = this->sources_[source];
+    size_t accepted = std::min(len, this->source_buffer_size_ - (staging.head - staging.tail));
+    for (size_t i = 0; i < accepted; i++)
+        staging.data[(staging.head + i) & (this->source_buffer_size_ - 1)] = data[i];
+    staging.head += accepted;
+    if (accepted < len) {
+        staging.dropped += len - accepted;
+        ESP_LOGW(TAG, "Staging buffer of source %u is full, dropped %zu bytes", source, len - accepted);
+    }
+    return accepted;
+}
+
+void StreamServerComponent::merge() {
+    // Take turns between the sources, each merging at most MERGE_QUANTUM bytes per turn, for as long as there is room in
+    // the ring. A busy source thus can't starve the others.
+    uint8_t idle = 0;
+    while (idle < this->sources_count_) {
+        Source &source = this->sources_[this->next_source_];
+        uint8_t id = this->next_source_;
+        this->next_source_ = (this->next_source_ + 1) % this->sources_count_;
+
+        size_t free = this->buf_size_ - (this->buf_head_ - this->buf_tail_);
+        size_t header = this->source_tagging_ == SourceTagging::IN_BAND ? 3 : 0;
+        size_t len = std::min(source.head - source.tail, MERGE_QUANTUM);
+        if (free <= header)
+            return;
+        len = std::min(len, free - header);
+        if (len == 0) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        if (header > 0) {
+            const uint8_t tag[] = {id, uint8_t(len >> 8), uint8_t(len & 0xFF)};
+            this->publish(tag, sizeof(tag));
+        }
+        size_t index = source.tail & (this->source_buffer_size_ - 1);
+        size_t first = std::min(len, this->source_buffer_size_ - index);
+        this->publish(&source.data[index], first);
+        this->publish(&source.data[0], len - first);
+        source.tail += len;
+        binlog(BinlogId::MERGE, len, id);
+        if (this->source_tagging_ == SourceTagging::FRAME_INDEX)
+            this->end_frame(id);
+    }
+}
+
+uint8_t *StreamServerComponent::prepare(size_t *len) {
+    size_t free = this->buf_size_ - (this->buf_head_ - this->buf_tail_);
+    *len = std::min(free, this->buf_ahead(this->buf_head_));
+    return &this->buf[this->buf_index(this->buf_head_)];
+}
+
+void StreamServerComponent::commit(size_t len) {
+    if (this != binlog_server_)
+        binlog(BinlogId::PUBLISH, len, this->port_);
+    if (this->merge_into_ != nullptr)
+        this->merge_into_->publish(this->source_id_, &this->buf[this->buf_index(this->buf_head_)], len);
+    this->buf_head_ += len;
+}
+
+void StreamServerComponent::end_frame(uint8_t type) {
+    if (this->frames_size_ == 0 || this->buf_head_ == this->frame_start_)
+        return;
+
+    // FNV-1a is fast and good enough to detect repeated frames.
+    size_t start = this->buf_head_ - std::min(this->buf_head_ - this->frame_start_, this->buf_size_);
+    uint32_t hash = 2166136261UL;
+    for (size_t position = start; position != this->buf_head_; position++) {
+        hash ^= this->buf[this->buf_index(position)];
+        hash *= 16777619UL;
+    }
+
+    Frame &frame = this->frames_[this->frames_count_++ % this->frames_size_];
+    frame.position = start;
+    frame.length = this->buf_head_ - start;
+    frame.hash = hash;
+    frame.type = type & 0x0F;
+    this->frame_start_ = this->buf_head_;
+}
+
+bool StreamServerComponent::resize(size_t size) {
+    if (size == 0 || (size & (size - 1)) != 0) {
+        ESP_LOGW(TAG, "Buffer size %zu is not a power of two", size);
+        return false;
+    }
+    if (size > this->buf_size_ && this->pressure_ != MemoryPressure::NORMAL) {
+        ESP_LOGW(TAG, "Not growing the buffer to %zu bytes, memory is low", size);
+        return false;
+    }
+    if (!this->reallocate(size))
+        return false;
+    this->ring_size_ = size;
+    return true;
+}
+
+bool StreamServerComponent::reallocate(size_t size) {
+    if (size == this->buf_size_)
+        return true;
+    std::unique_ptr<uint8_t[]> buf{new (std::nothrow) uint8_t[size]};
+    if (!buf) {
+        ESP_LOGW(TAG, "Failed to allocate a buffer of %zu bytes", size);
+        return false;
+    }
+
+    // Retained data that doesn't fit in the new ring is dropped, as if the ring had overflowed.
+    if (this->buf_head_ - this->buf_tail_ > size)
+        this->discard(this->buf_head_ - this->buf_tail_ - size);
+
+    // Positions are absolute, so the clients, the sink and the frame index keep theirs, and only the data moves. As much
+    // of the recent data as fits is kept, for best-effort clients that are behind the tail.
+    size_t position = this->buf_head_ - std::min({size, this->buf_size_, this->buf_head_});
+    while (position != this->buf_head_) {
+        size_t index = position & (size - 1);
+        size_t chunk = std::min({this->buf_head_ - position, this->buf_ahead(position), size - index});
+        std::memcpy(&buf[index], &this->buf[this->buf_index(position)], chunk);
+        position += chunk;
+    }
+
+    size_t old_size = this->buf_size_;
+    this->buf = std::move(buf);
+    this->buf_size_ = size;
+    ESP_LOGI(TAG, "Resized buffer from %zu to %zu bytes", old_size, size);
+    return true;
+}
+
+void StreamServerComponent::discard(size_t len) {
+    ESP_LOGE(TAG, "Outgoing buffer is full, dropping pending bytes: stream will be corrupted!");
+    this->buf_tail_ += std::min(len, this->buf_size_);
     for (Client &client : this->clients_) {
-        if (client.disconnected || client.position == this->buf_head_)
+        if (client.position < this->buf_tail_) {
+            this->bytes_dropped_ += this->buf_tail_ - client.position;
+            binlog(BinlogId::DROP, this->buf_tail_ - client.position, this->port_);
+            client.position = this->buf_tail_;
+        }
+    }
+    this->outbound_position_ = std::max(this->outbound_position_, this->buf_tail_);
+    this->sink_position_ = std::max(this->sink_position_, this->buf_tail_);
+    if (this->mux_ != nullptr)
+        this->mux_->channel_discard(this->channel_, this->buf_tail_);
+}
+
+size_t StreamServerComponent::extract_urgent(Client &client, uint8_t *data, size_t len) {
+    // Remove the urgent bytes from the data in place, and pass them on right away. The bulk data follows in write().
+    uint8_t urgent[16];
+    size_t urgent_len = 0, out = 0;
+    // Urgent bytes are passed on in chunks of the size of the buffer.
+    auto deliver = [&]() {
+        binlog(BinlogId::URGENT, urgent_len, this->port_);
+        this->client_data_callback_.call(urgent, urgent_len);
+        urgent_len = 0;
+    };
+    auto add_urgent = [&](uint8_t byte) {
+        urgent[urgent_len++] = byte;
+        if (urgent_len == sizeof(urgent))
+            deliver();
+    };
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        if (client.iac) {
+            client.iac = false;
+            if (byte == TELNET_IP || byte == TELNET_BRK) {
+                // Drop the IAC as well, unless it was already passed on with the previous data.
+                if (out > 0 && data[out - 1] == TELNET_IAC)
+                    out--;
+                if (byte == TELNET_BRK)
+                    this->break_callback_.call();
+                else
+                    add_urgent(0x03);
+                continue;
+            }
+        } else if (this->telnet_urgent_ && byte == TELNET_IAC) {
+            client.iac = true;
+        } else if (this->urgent_[byte / 32] & (1UL << (byte % 32))) {
+            add_urgent(byte);
             continue;
+        }
+        data[out++] = byte;
+    }
 
-        struct iovec iov[2];
-        iov[0].iov_base = &this->buf[this->buf_index(client.position)];  // Change 'buf_' to 'buf'
-        iov[0].iov_len = std::min(this->buf_head_ - client.position, this->buf_ahead(client.position));
-        iov[1].iov_base = &this->buf[0];  // Change 'buf_' to 'buf'
-        iov[1].iov_len = this->buf_head_ - (client.position + iov[0].iov_len);
-        if ((written = client.socket->writev(iov, 2)) > 0) {
-            client.position += written;
-        } else if (written == 0 || errno == ECONNRESET) {
-            ESP_LOGD(TAG, "Client %s disconnected", client.identifier.c_str());
-            client.disconnected = true;
+    if (urgent_len > 0)
+        deliver();
+    return out;
+}
+
+bool StreamServerComponent::send(uint32_t client, const uint8_t *data, size_t len) {
+    for (Client &c : this->clients_) {
+        if (c.number == client && !c.disconnected)
+            return c.control->push(data, len);
+    }
+    return false;
+}
+
+bool StreamServerComponent::ControlQueue::push(const uint8_t *message, size_t len) {
+    if (this->count == SLOTS || len > SLOT_SIZE)
+        return false;
+
+    uint8_t slot = (this->head + this->count) % SLOTS;
+    std::memcpy(this->data[slot], message, len);
+    this->len[slot] = len;
+    this->count++;
+    return true;
+}
+
+int StreamServerComponent::ControlQueue::fill(struct iovec *iov) const {
+    for (uint8_t i = 0; i < this->count; i++) {
+        uint8_t slot = (this->head + i) % SLOTS;
+        uint16_t offset = i == 0 ? this->sent : 0;
+        iov[i].iov_base = const_cast<uint8_t *>(&this->data[slot][offset]);
+        iov[i].iov_len = this->len[slot] - offset;
+    }
+    return this->count;
+}
+
+size_t StreamServerComponent::ControlQueue::consume(size_t len) {
+    size_t consumed = 0;
+    while (this->count > 0 && consumed < len) {
+        size_t chunk = std::min<size_t>(len - consumed, this->len[this->head] - this->sent);
+        consumed += chunk;
+        this->sent += chunk;
+        if (this->sent == this->len[this->head]) {
+            this->sent = 0;
+            this->head = (this->head + 1) % SLOTS;
+            this->count--;
+        }
+    }
+    return consumed;
+}
+
+void StreamServerComponent::init_client(Client &client) {
+    client.number = this->next_client_number_++;
+    for (StreamServerComponent *channel : this->channels_)
+        client.channels.push_back(Client::Channel{channel->buf_head_, this->channel_window_, 0});
+}
+
+void StreamServerComponent::flush_channels(Client &client) {
+    // Each segment of the writev() is either control data, a frame header or (part of) a frame payload. Channels are
+    // served round-robin, each sending at most CHANNEL_QUANTUM bytes per pass within its credit.
+    enum Kind : uint8_t { CONTROL, HEADER, PAYLOAD };
+    struct iovec iov[ControlQueue::SLOTS + 2 * MAX_CHANNELS];
+    Kind kind[ControlQueue::SLOTS + 2 * MAX_CHANNELS];
+    uint8_t channel[ControlQueue::SLOTS + 2 * MAX_CHANNELS];
+    uint8_t headers[MAX_CHANNELS][3];
+    int count = 0;
+
+    auto add_payload = [&](uint8_t index, size_t len) {
+        StreamServerComponent *server = this->channels_[index];
+        size_t position = client.channels[index].position;
+        len = std::min({len, server->buf_head_ - position, server->buf_ahead(position)});
+        iov[count] = {&server->buf[server->buf_index(position)], len};
+        kind[count] = PAYLOAD;
+        channel[count++] = index;
+    };
+
+    // A frame that was partially written has to be finished first, as frames can't be interleaved.
+    if (client.tx_remaining > 0) {
+        if (client.tx_header_sent < 3) {
+            iov[count] = {&client.tx_header[client.tx_header_sent], size_t(3 - client.tx_header_sent)};
+            kind[count] = HEADER;
+            channel[count++] = client.tx_channel;
+        }
+        add_payload(client.tx_channel, client.tx_remaining);
+    } else {
+        // Send the grants that didn't fit in the control queue before.
+        this->grant_credit(client);
+        count = client.control->fill(iov);
+        for (int i = 0; i < count; i++)
+            kind[i] = CONTROL;
+
+        for (uint8_t i = 0; i < this->channels_.size(); i++) {
+            uint8_t index = (client.next_channel + i) % this->channels_.size();
+            StreamServerComponent *server = this->channels_[index];
+            Client::Channel &state = client.channels[index];
+            size_t len = std::min({server->buf_head_ - state.position, server->buf_ahead(state.position), state.credit,
+                                   CHANNEL_QUANTUM});
+            if (len == 0)
+                continue;
+
+            headers[i][0] = index + 1;
+            headers[i][1] = len >> 8;
+            headers[i][2] = len & 0xFF;
+            iov[count] = {headers[i], 3};
+            kind[count] = HEADER;
+            channel[count++] = index;
+            add_payload(index, len);
+        }
+        client.next_channel = (client.next_channel + 1) % this->channels_.size();
+    }
+
+    if (count == 0 || (count == 1 && iov[0].iov_len == 0))
+        return;
+
+    ssize_t written = client.socket->writev(iov, count);
+    if (written > 0)
+        this->bytes_written_ += written;
+    if (written == 0 || (written < 0 && errno == ECONNRESET)) {
+        ESP_LOGD(TAG, "Client %s disconnected", client.identifier.c_str());
+        client.disconnected = true;
+        return;
+    } else if (written < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN)
+            ESP_LOGE(TAG, "Failed to write to client %s with error %d!", client.identifier.c_str(), errno);
+        return;
+    }
+
+    written -= client.control->consume(written);
+    for (int i = 0; i < count && written > 0; i++) {
+        if (kind[i] == CONTROL)
             continue;
-        } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            // Expected if the (TCP) transmit buffer is full, nothing to do.
+
+        size_t len = std::min<size_t>(written, iov[i].iov_len);
+        written -= len;
+        if (kind[i] == HEADER) {
+            if (client.tx_remaining == 0) {
+                // Start of a new frame, its payload length is in the header.
+                std::memcpy(client.tx_header, iov[i].iov_base, 3);
+                client.tx_header_sent = 0;
+                client.tx_remaining = (client.tx_header[1] << 8) | client.tx_header[2];
+                client.tx_channel = channel[i];
+            }
+            client.tx_header_sent += len;
         } else {
-            ESP_LOGE(TAG, "Failed to write to client %s with error %d!", client.identifier.c_str(), errno);
+            client.channels[channel[i]].position += len;
+            client.channels[channel[i]].credit -= len;
+            client.tx_remaining -= len;
         }
-        this->buf_tail_ = std::min(this->buf_tail_, client.position);
     }
 }
 
-void StreamServerComponent::write() {
-    int available;
-    // There is no UART stream anymore; this function now doesn't do anything.
-    // You can replace it with a custom data source if necessary (e.g., network, file).
+void StreamServerComponent::demux(Client &client, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (client.rx_header_len < 3) {
+            client.rx_header[client.rx_header_len++] = *data++;
+            len--;
+            if (client.rx_header_len == 3) {
+                client.rx_remaining = (client.rx_header[1] << 8) | client.rx_header[2];
+                client.rx_control_len = 0;
+            }
+        } else {
+            uint8_t id = client.rx_header[0];
+            size_t chunk = std::min(len, client.rx_remaining);
+            if (id == 0) {
+                // Control messages may be split across reads, so their payload is collected before it's handled.
+                size_t take = std::min<size_t>(chunk, sizeof(client.rx_control) - client.rx_control_len);
+                std::memcpy(&client.rx_control[client.rx_control_len], data, take);
+                client.rx_control_len += take;
+                const uint8_t *control = client.rx_control;
+                if (chunk == client.rx_remaining && client.rx_header[1] == 0 && client.rx_header[2] == 4 &&
+                    control[0] == CONTROL_CREDIT && control[1] >= 1 && control[1] <= client.channels.size())
+                    client.channels[control[1] - 1].credit += (control[2] << 8) | control[3];
+            } else if (id <= this->channels_.size()) {
+                StreamServerComponent *server = this->channels_[id - 1];
+                server->received_data_.insert(server->received_data_.end(), data, data + chunk);
+                client.channels[id - 1].consumed += chunk;
+                this->grant_credit(client);
+            } else {
+                ESP_LOGW(TAG, "Dropping %zu bytes for unknown channel %u from client %s", chunk, id, client.identifier.c_str());
+            }
+            data += chunk;
+            len -= chunk;
+            client.rx_remaining -= chunk;
+        }
+
+        if (client.rx_header_len == 3 && client.rx_remaining == 0)
+            client.rx_header_len = 0;
+    }
+}
+
+bool StreamServerComponent::send_control(Client &client, uint8_t type, uint8_t channel, uint16_t value) {
+    const uint8_t frame[] = {0, 0, 4, type, channel, uint8_t(value >> 8), uint8_t(value & 0xFF)};
+    return client.control->push(frame, sizeof(frame));
+}
+
+void StreamServerComponent::grant_credit(Client &client) {
+    // Grant the peer new credit once half of the window has been handed to a channel. When the control queue is full,
+    // the grant stays owed and is folded into the next one, as credit that is never granted stalls the channel.
+    for (uint8_t i = 0; i < client.channels.size(); i++) {
+        Client::Channel &state = client.channels[i];
+        if (state.consumed < this->channel_window_ / 2)
+            continue;
+        uint16_t grant = std::min<size_t>(state.consumed, UINT16_MAX);
+        if (!this->send_control(client, CONTROL_CREDIT, i + 1, grant))
+            return;
+        state.consumed -= grant;
+    }
+}
+
+size_t StreamServerComponent::channel_tail(uint8_t channel, size_t tail) {
+    for (const Client &client : this->clients_) {
+        if (!client.disconnected && !client.channels.empty())
+            tail = std::min(tail, client.channels[channel - 1].position);
+    }
+    return tail;
 }
 
-void StreamServerComponent::parse_modbus_request(uint8_t *buf, ssize_t len) {
-    if (len < 12) return;  // Minimal Modbus TCP frame size
+void StreamServerComponent::channel_discard(uint8_t channel, size_t tail) {
+    for (Client &client : this->clients_) {
+        if (!client.channels.empty() && client.channels[channel - 1].position < tail)
+            client.channels[channel - 1].position = tail;
+    }
+}
+
+bool StreamServerComponent::take(uint8_t *dest, uint16_t need, uint16_t &received, const uint8_t *&data, size_t &len) {
+    size_t chunk = std::min<size_t>(need - received, len);
+    std::memcpy(dest + received, data, chunk);
+    received += chunk;
+    data += chunk;
+    len -= chunk;
+    return received == need;
+}
+
+void StreamServerComponent::run_modbus(Client &client, ProtocolFrame &frame, const uint8_t *&data, size_t &len) {
+    CO_BEGIN(frame.resume);
+    while (true) {
+        // MBAP header: transaction ID, protocol ID, length (of the unit ID and PDU), unit ID.
+        frame.received = 0;
+        CO_AWAIT(frame.resume, take(frame.header, sizeof(frame.header), frame.received, data, len));
+        frame.pdu_len = ((frame.header[4] << 8) | frame.header[5]) - 1;
+        if (frame.header[2] != 0 || frame.header[3] != 0 || frame.pdu_len == 0 || frame.pdu_len > sizeof(frame.pdu)) {
+            ESP_LOGW(TAG, "Invalid Modbus request from client %s", client.identifier.c_str());
+            client.disconnected = true;
+            len = 0;
+            break;
+        }
+
+        frame.received = 0;
+        CO_AWAIT(frame.resume, take(frame.pdu, frame.pdu_len, frame.received, data, len));
+        // A client that pipelines requests may be ahead of the responses it takes, so wait until the response fits.
+        CO_AWAIT(frame.resume, !client.control->full());
+        this->handle_modbus_request(client, frame);
+    }
+    CO_END(frame.resume);
+}
 
-    // Modbus TCP frame structure
-    uint8_t unit_id = buf[6];  // Unit identifier
-    uint8_t function_code = buf[7];  // Modbus function code (e.g., 3 for Read Holding Registers)
-    
-    uint16_t register_address = (buf[9] << 8) | buf[10];  // Register address
-    uint8_t num_registers = buf[12];  // Number of registers requested
+void StreamServerComponent::handle_modbus_request(Client &client, const ProtocolFrame &frame) {
+    uint8_t unit_id = frame.header[6];  // Unit identifier
+    uint8_t function_code = frame.pdu[0];  // Modbus function code (e.g., 3 for Read Holding Registers)
+    uint16_t register_address = frame.pdu_len >= 5 ? (frame.pdu[1] << 8) | frame.pdu[2] : 0;  // Register address
+    uint16_t num_registers = frame.pdu_len >= 5 ? (frame.pdu[3] << 8) | frame.pdu[4] : 0;  // Number of registers requested
 
     ESP_LOGD(TAG, "Modbus Request - Unit ID: %d, Function Code: %d, Register Address: %d, Num Registers: %d",
              unit_id, function_code, register_address, num_registers);
 
-    // Check if the function code is 3 (Read Holding Registers)
-    if (function_code == 3) {
-        // Check that the number of registers is valid (1-125)
-        if (num_registers < 1 || num_registers > 125) {
-            ESP_LOGE(TAG, "Invalid number of registers requested: %d", num_registers);
-            return;  // Invalid register count, return early
+    // The response starts with the MBAP header of the request, with the length filled in below.
+    uint8_t response[ControlQueue::SLOT_SIZE];
+    std::memcpy(response, frame.header, sizeof(frame.header));
+    size_t len = sizeof(frame.header);
+    response[len++] = function_code;
+
+    uint8_t exception = 0;
+    switch (function_code) {
+        case 3:  // Read Holding Registers
+        case 4:  // Read Input Registers
+        {
+            if (frame.pdu_len != 5 || num_registers < 1 || num_registers > 125) {
+                exception = 0x03;
+                break;
+            }
+            // The registers are copied from a consistent snapshot of the image.
+            uint16_t values[125];
+            RegisterImage &image = function_code == 3 ? this->holding_image_ : this->input_image_;
+            if (!image.read(register_address, values, num_registers)) {
+                exception = 0x02;
+                break;
+            }
+            response[len++] = 2 * num_registers;  // Byte count (each register is 2 bytes)
+            for (uint16_t i = 0; i < num_registers; i++) {
+                response[len++] = (values[i] >> 8) & 0xFF;  // High byte
+                response[len++] = values[i] & 0xFF;  // Low byte
+            }
+            break;
         }
+        case 6:  // Write Single Register, the response echoes the request
+            if (frame.pdu_len != 5) {
+                exception = 0x03;
+                break;
+            }
+            if ((exception = this->write_registers(register_address, 1, &frame.pdu[3])) == 0) {
+                std::memcpy(&response[len], &frame.pdu[1], 4);
+                len += 4;
+            }
+            break;
+        case 16:  // Write Multiple Registers, the response echoes the address and count
+            if (frame.pdu_len < 6 || num_registers < 1 || num_registers > 123 || frame.pdu[5] != 2 * num_registers ||
+                frame.pdu_len != 6 + frame.pdu[5]) {
+                exception = 0x03;
+                break;
+            }
+            if ((exception = this->write_registers(register_address, num_registers, &frame.pdu[6])) == 0) {
+                std::memcpy(&response[len], &frame.pdu[1], 4);
+                len += 4;
+            }
+            break;
+        default:
+            exception = 0x01;
+            break;
+    }
 
-        // Prepare a Modbus response
-        uint8_t response[5 + 2 * num_registers];  // Start with the header and register values
-        response[0] = buf[0];  // Transaction Identifier (copy from request)
-        response[1] = buf[1];
-        response[2] = buf[2];  // Protocol Identifier (copy from request)
-        response[3] = buf[3];
-        response[4] = 2 * num_registers;  // Byte count (each register is 2 bytes)
+    if (exception != 0) {
+        // Exception response: illegal function, data address or data value.
+        ESP_LOGW(TAG, "Rejected Modbus request, function code: %d, exception: %d", function_code, exception);
+        response[len - 1] |= 0x80;
+        response[len++] = exception;
+    }
 
-        // Function Code for the response (same as the request)
-        response[5] = function_code;
+    response[4] = (len - 6) >> 8;
+    response[5] = (len - 6) & 0xFF;
+    client.control->push(response, len);
+}
 
-        // Fill register values into the response
-        for (uint8_t i = 0; i < num_registers; i++) {
-            // Here you would retrieve actual register values. For now, we'll just simulate some values.
-            uint16_t register_value = 0x1234 + i;  // Example value, adjust as needed
-            response[6 + i * 2] = (register_value >> 8) & 0xFF;  // High byte
-            response[7 + i * 2] = register_value & 0xFF;  // Low byte
+uint8_t StreamServerComponent::write_registers(uint16_t address, uint16_t count, const uint8_t *values) {
+    // A write must cover its mapped registers completely, so it's checked before anything is written. Then every mapping
+    // is written once, no matter how many of its registers the request contains.
+    uint32_t end = address + count;
+    uint16_t covered = 0;
+    for (const HoldingRegister &reg : this->holding_registers_) {
+        uint32_t reg_end = reg.address + register_width(reg.format);
+        if (reg.address >= end || reg_end <= address)
+            continue;
+        if (reg.address < address || reg_end > end)
+            return 0x02;
+        covered += register_width(reg.format);
+    }
+    if (covered != count)
+        return 0x02;
+
+    uint16_t words[123];
+    for (uint16_t i = 0; i < count; i++)
+        words[i] = (values[2 * i] << 8) | values[2 * i + 1];
+    this->holding_image_.write(address, words, count);
+
+    for (const HoldingRegister &reg : this->holding_registers_) {
+        if (reg.address < address || reg.address >= end)
+            continue;
+        const uint8_t *value = &values[2 * (reg.address - address)];
+        uint32_t raw = (value[0] << 8) | value[1];
+        if (register_width(reg.format) == 2)
+            raw = (raw << 16) | (value[2] << 8) | value[3];
+
+        float decoded;
+        switch (reg.format) {
+            case RegisterFormat::U16:
+            case RegisterFormat::U32:
+                decoded = raw;
+                break;
+            case RegisterFormat::S16:
+                decoded = static_cast<int16_t>(raw);
+                break;
+            case RegisterFormat::S32:
+                decoded = static_cast<int32_t>(raw);
+                break;
+            case RegisterFormat::FLOAT32:
+                std::memcpy(&decoded, &raw, sizeof(decoded));
+                break;
         }
+        reg.write(decoded);
+    }
+    return 0;
+}
+
+// Limits a value to the range of an integer format, so converting it is defined. NaN has no integer value and reads as 0.
+static double clamp_register(float value, double min, double max) {
+    if (std::isnan(value))
+        return 0;
+    return std::min(std::max<double>(value, min), max);
+}
+
+void StreamServerComponent::set_register(RegisterImage &image, uint16_t address, RegisterFormat format, float value) {
+    uint32_t raw;
+    switch (format) {
+        case RegisterFormat::U16:
+            raw = static_cast<uint32_t>(clamp_register(value, 0, UINT16_MAX));
+            break;
+        case RegisterFormat::U32:
+            raw = static_cast<uint32_t>(clamp_register(value, 0, UINT32_MAX));
+            break;
+        case RegisterFormat::S16:
+            raw = static_cast<uint32_t>(static_cast<int32_t>(clamp_register(value, INT16_MIN, INT16_MAX)));
+            break;
+        case RegisterFormat::S32:
+            raw = static_cast<uint32_t>(static_cast<int32_t>(clamp_register(value, INT32_MIN, INT32_MAX)));
+            break;
+        case RegisterFormat::FLOAT32:
+            std::memcpy(&raw, &value, sizeof(raw));
+            break;
+    }
 
-        // Send the response back to the client (you would need to implement the actual sending logic)
-        // this->send_response(response, sizeof(response));  // Send back the response
+    // Both words of a 32-bit value are written in a single update, so a read never sees half of it.
+    uint16_t words[2];
+    if (register_width(format) == 2) {
+        words[0] = raw >> 16;
+        words[1] = raw & 0xFFFF;
     } else {
-        ESP_LOGE(TAG, "Unsupported function code: %d", function_code);
+        words[0] = raw & 0xFFFF;
     }
+    image.write(address, words, register_width(format));
 }
 
 
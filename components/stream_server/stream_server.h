@@ -1,19 +1,94 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
 #include "esphome/components/socket/socket.h"
 
+#include "binlog.h"
+#include "coroutine.h"
+#include "metrics.h"
+#include "register_image.h"
+#include "replay.h"
+#include "timer_wheel.h"
+
 #ifdef USE_BINARY_SENSOR
 #include "esphome/components/binary_sensor/binary_sensor.h"
 #endif
 #ifdef USE_SENSOR
 #include "esphome/components/sensor/sensor.h"
 #endif
+#ifdef USE_MQTT
+#include "esphome/components/mqtt/mqtt_client.h"
+#endif
+#ifdef USE_LOGGER
+#include "esphome/components/logger/logger.h"
+#endif
 
+#ifndef USE_HOST
+#include <lwip/ip_addr.h>
+#endif
+#ifdef USE_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+// Lightweight view of data received from a client, only valid for the duration of the callback that receives it.
+struct StreamView {
+    const uint8_t *data{nullptr};
+    size_t size{0};
+
+    const uint8_t *begin() const { return this->data; }
+    const uint8_t *end() const { return this->data + this->size; }
+    uint8_t operator[](size_t index) const { return this->data[index]; }
+    bool starts_with(const std::vector<uint8_t> &prefix) const {
+        return prefix.size() <= this->size && std::equal(prefix.begin(), prefix.end(), this->data);
+    }
+    std::string str() const { return std::string(reinterpret_cast<const char *>(this->data), this->size); }
+};
+
+// Primary clients are flushed first, best-effort clients last and only while there is time left. Best-effort clients
+// also don't hold back the data in the ring, so they lose data instead of the other clients when they fall behind.
+enum class ClientPriority : uint8_t {
+    PRIMARY,
+    NORMAL,
+    BEST_EFFORT,
+};
+
+// How merged data is tagged with its source: in-band with a header of the source ID and a 16-bit big-endian length, or as
+// the type of the frame in the frame index.
+enum class SourceTagging : uint8_t {
+    IN_BAND,
+    FRAME_INDEX,
+};
+
+// Memory pressure, from the largest free block of the heap. Each level adds a step to shed memory: the ring is shrunk,
+// then new clients are refused, then best-effort clients are dropped as well.
+enum class MemoryPressure : uint8_t {
+    NORMAL,
+    SHRINK,
+    REFUSE,
+    DROP,
+};
+
+// Encoding of a value in Modbus registers. 32-bit values span two registers, with the high word first.
+enum class RegisterFormat : uint8_t {
+    U16,
+    S16,
+    U32,
+    S32,
+    FLOAT32,
+};
+
+inline uint16_t register_width(RegisterFormat format) { return format >= RegisterFormat::U32 ? 2 : 1; }
+
 class StreamServerComponent : public esphome::Component {
 public:
     StreamServerComponent() = default;
@@ -23,7 +98,49 @@ public:
 #endif
 #ifdef USE_SENSOR
     void set_connection_count_sensor(esphome::sensor::Sensor *connection_count) { this->connection_count_sensor_ = connection_count; }
+    void set_memory_usage_sensor(esphome::sensor::Sensor *memory_usage) { this->memory_usage_sensor_ = memory_usage; }
+    void set_heap_largest_block_sensor(esphome::sensor::Sensor *largest_block) { this->heap_largest_block_sensor_ = largest_block; }
+    void set_heap_fragmentation_sensor(esphome::sensor::Sensor *fragmentation) { this->heap_fragmentation_sensor_ = fragmentation; }
+    void set_memory_pressure_sensor(esphome::sensor::Sensor *pressure) { this->memory_pressure_sensor_ = pressure; }
+    void set_benchmark_throughput_sensor(esphome::sensor::Sensor *throughput) { this->benchmark_throughput_sensor_ = throughput; }
+    void set_benchmark_loop_time_sensor(esphome::sensor::Sensor *loop_time) { this->benchmark_loop_time_sensor_ = loop_time; }
+    void set_benchmark_drop_rate_sensor(esphome::sensor::Sensor *drop_rate) { this->benchmark_drop_rate_sensor_ = drop_rate; }
 #endif
+    void set_diagnostics_interval(uint32_t interval) {
+        if (this->diagnostics_interval_ == 0 || interval < this->diagnostics_interval_)
+            this->diagnostics_interval_ = interval;
+    }
+    // Sample the heap every interval ms, and shed memory when its largest free block is below the watermark of a level.
+    void set_memory_governor(size_t shrink, size_t refuse, size_t drop, uint32_t interval) {
+        this->watermarks_[0] = shrink;
+        this->watermarks_[1] = refuse;
+        this->watermarks_[2] = drop;
+        this->governor_interval_ = interval;
+    }
+    MemoryPressure get_memory_pressure() const { return this->pressure_; }
+    // Serve the metrics of all stream servers for Prometheus, on the given port (see metrics.h).
+    void set_metrics_port(uint16_t port) { this->metrics_ = std::unique_ptr<MetricsEndpoint>{new MetricsEndpoint(port)}; }
+    // Self-benchmark: generate rate bytes/s of records that clients can verify with tools/verify_benchmark.py, and measure
+    // the throughput to the clients, the time per loop and the share of records that didn't fit in the ring.
+    void set_benchmark(uint32_t rate) { this->benchmark_rate_ = rate; }
+#ifdef USE_HOST
+    // Replay a session recorded in the binary log (see replay.h), instead of waiting for real clients.
+    void set_replay(const std::string &path, bool max_speed) {
+        this->replay_ = std::unique_ptr<TraceReplay>{new TraceReplay(path, max_speed)};
+    }
+#endif
+
+    // RAM allocated by this server, in bytes, by purpose.
+    struct MemoryUsage {
+        size_t ring;
+        size_t clients;
+        size_t received;
+        size_t protocol;
+        size_t other;
+
+        size_t total() const { return this->ring + this->clients + this->received + this->protocol + this->other; }
+    };
+    MemoryUsage memory_usage() const;
 
     void setup() override;
     void loop() override;
@@ -32,48 +149,497 @@ public:
 
     float get_setup_priority() const override { return esphome::setup_priority::AFTER_WIFI; }
 
+    void set_buffer_size(size_t size) { this->buf_size_ = this->ring_size_ = size; }
+    // Reallocate the ring at runtime, keeping the buffered data and the position of each client. When the ring shrinks
+    // below the retained data, the oldest data is dropped. Returns false when the size is invalid or can't be allocated.
+    bool resize(size_t size);
     void set_port(uint16_t port) { this->port_ = port; }
+    // Outbound mode: instead of listening, connect to the given address (an IP address or a host name, which is resolved
+    // before each connection attempt) and stream to it as a client.
+    void set_outbound_address(const std::string &address, uint16_t port) {
+        this->outbound_address_ = address;
+        this->outbound_port_ = port;
+    }
+    void set_outbound_backoff(uint32_t min_backoff, uint32_t max_backoff) {
+        this->min_backoff_ = min_backoff;
+        this->max_backoff_ = max_backoff;
+    }
+    // Bridge mode: pair with another stream server in bridge mode, one side connecting to the other. Both sides resume
+    // from the offset the peer has received after a reconnect, and detect when data was lost in between.
+    void set_bridge(bool bridge) { this->bridge_ = bridge; }
+    // Urgent bytes (e.g. Ctrl-C) and the telnet IP/BRK commands are passed to the consumers as soon as they're received,
+    // ahead of the other data that was received from the clients.
+    void add_urgent_byte(uint8_t byte) { this->urgent_[byte / 32] |= 1UL << (byte % 32); this->has_urgent_ = true; }
+    void set_telnet_urgent(bool telnet_urgent) { this->telnet_urgent_ = telnet_urgent; this->has_urgent_ |= telnet_urgent; }
+    // Clients are classified by the first rule that matches their IPv4 address, or the default priority of this port.
+    void set_default_priority(ClientPriority priority) { this->default_priority_ = priority; }
+    void add_priority_rule(uint32_t network, uint32_t mask, ClientPriority priority) {
+        this->priority_rules_.push_back(PriorityRule{network & mask, mask, priority});
+    }
+    void set_flush_budget(uint32_t flush_budget) { this->flush_budget_ = flush_budget; }
+    void set_frame_index_size(size_t size) { this->frames_size_ = size; }
+    // Only send frames that differ from the previous frame of the same type, and every frame once per keyframe interval.
+    void set_changes_only(bool changes_only, uint32_t keyframe_interval) {
+        this->changes_only_ = changes_only;
+        this->keyframe_interval_ = keyframe_interval;
+    }
+    // MQTT sink: publish the data in the ring to a topic, in messages of at most batch_size bytes that are sent when full
+    // or when the interval has passed. With by_frame, messages only contain whole frames from the frame index. The
+    // publisher defaults to the MQTT client; when it returns false the data is retained and retried, like a slow client.
+    void set_sink(const std::string &topic, size_t batch_size, uint32_t interval, bool by_frame) {
+        this->sink_topic_ = topic;
+        this->sink_batch_size_ = batch_size;
+        this->sink_interval_ = interval;
+        this->sink_by_frame_ = by_frame;
+    }
+    void set_sink_publisher(std::function<bool(const std::string &, const uint8_t *, size_t)> &&publisher) {
+        this->sink_publisher_ = std::move(publisher);
+    }
+#ifdef USE_LOGGER
+    // Serve the log output of the device at or below the given level. Log lines that don't fit in the ring are dropped
+    // and counted, so logging never waits for the clients.
+    void set_log_level(int log_level) { this->log_level_ = log_level; }
+    uint32_t get_log_dropped() const { return this->log_dropped_; }
+#endif
+    // Serve the binary log records of all stream servers, see binlog.h.
+    void set_binary_log(bool binary_log) { this->binary_log_ = binary_log; }
+    template<typename... Args> static void binlog(BinlogId id, Args... args) {
+        if (binlog_server_ == nullptr)
+            return;
+
+        uint8_t record[BINLOG_HEADER_SIZE + 4 * sizeof...(Args)];
+        record[0] = static_cast<uint8_t>(id);
+        binlog_put_u32(&record[1], esphome::micros());
+        const uint32_t values[] = {static_cast<uint32_t>(args)..., 0};
+        for (size_t i = 0; i < sizeof...(Args); i++)
+            binlog_put_u32(&record[BINLOG_HEADER_SIZE + 4 * i], values[i]);
+        binlog_server_->append_binlog(record, sizeof(record));
+    }
+    // Protocol handling: with the Modbus protocol, requests from clients are answered by this component instead of being
+    // passed to the consumers. Each client runs a handler coroutine, whose frame is one of a fixed number of slots.
+    void set_modbus(uint8_t slots) { this->protocol_slots_ = slots; }
+    // Map holding registers to a setter, which is called once with the decoded value whenever a write covers them. If a
+    // getter is given, the registers are loaded with its value at setup.
+    void add_holding_register(uint16_t address, RegisterFormat format, std::function<void(float)> &&write,
+                              std::function<float()> &&read = nullptr) {
+        this->holding_registers_.push_back({address, format, std::move(write), std::move(read)});
+        this->holding_image_.include(address, register_width(format));
+    }
+    void add_input_register(uint16_t address, RegisterFormat format) {
+        this->input_image_.include(address, register_width(format));
+    }
+    // Update the value of registers that are served to clients. Unmapped registers within the tables read as zero.
+    void set_holding_register(uint16_t address, RegisterFormat format, float value) {
+        this->set_register(this->holding_image_, address, format, value);
+    }
+    void set_input_register(uint16_t address, RegisterFormat format, float value) {
+        this->set_register(this->input_image_, address, format, value);
+    }
+    // When a client can't keep up, hold back writes until batch_size bytes are pending or batch_timeout ms passed.
+    void set_batch(size_t batch_size, uint32_t batch_timeout) {
+        this->batch_size_ = batch_size;
+        this->batch_timeout_ = batch_timeout;
+    }
+
+    // Data API for other components. Published data is appended to the ring and sent to all clients; when the ring is
+    // full the oldest pending bytes are dropped, so a producer never blocks.
+    size_t publish(const uint8_t *data, size_t len);
+    // Zero-copy producer API: prepare() returns the contiguous free space at the head of the ring (its size in len),
+    // commit() makes the first len bytes of it visible to clients.
+    uint8_t *prepare(size_t *len);
+    void commit(size_t len);
+    // Merging: data published for one of several sources is staged per source, and merged into the ring in write(),
+    // taking turns between the sources. Data published on another stream server can be merged as a source as well.
+    size_t publish(uint8_t source, const uint8_t *data, size_t len);
+    void set_sources(uint8_t count, size_t buffer_size, SourceTagging tagging) {
+        this->sources_count_ = count;
+        this->source_buffer_size_ = buffer_size;
+        this->source_tagging_ = tagging;
+    }
+    void add_source(StreamServerComponent *server, uint8_t source) {
+        server->merge_into_ = this;
+        server->source_id_ = source;
+    }
+
+    // Framing: the data committed since the previous call forms a frame of the given type (0-15), which is recorded in a
+    // side index of the ring. Only available when the frame index is enabled.
+    void end_frame(uint8_t type = 0);
+
+    // Multiplexing: carry the rings of several stream servers over a single connection to this server, as frames of a
+    // channel ID, a 16-bit big-endian length and the payload. Channel 0 carries control messages, such as the credit
+    // grants that limit how much data the peer accepts for each channel.
+    void add_channel(StreamServerComponent *server) {
+        this->channels_.push_back(server);
+        server->mux_ = this;
+        server->channel_ = this->channels_.size();
+    }
+    void set_channel_window(uint16_t window) { this->channel_window_ = window; }
+
+    // Queue a message (e.g. a protocol reply) for a single client, to be sent ahead of the data in the ring. The client is
+    // identified by the number passed to the client callbacks, as several clients can connect from the same address.
+    // Returns false if the client doesn't exist or its queue is full.
+    bool send(uint32_t client, const uint8_t *data, size_t len);
+
+    // Consumer API: the callback receives the data sent by clients, as a view that is only valid during the call.
+    void add_on_client_data_callback(std::function<void(const uint8_t *, size_t)> &&callback) {
+        this->client_data_callback_.add(std::move(callback));
+    }
+    // Called when a client sends a telnet BRK command, if set_telnet_urgent() is enabled.
+    void add_on_break_callback(std::function<void()> &&callback) { this->break_callback_.add(std::move(callback)); }
+    // Per-client events, used by the automation triggers. They pass the number of the client, which is unique for this
+    // server, and its address. The data view points into the receive buffer.
+    void add_on_client_connected_callback(std::function<void(uint32_t, const std::string &)> &&callback) {
+        this->client_connected_callback_.add(std::move(callback));
+    }
+    void add_on_client_disconnected_callback(std::function<void(uint32_t, const std::string &)> &&callback) {
+        this->client_disconnected_callback_.add(std::move(callback));
+    }
+    void add_on_client_view_callback(std::function<void(uint32_t, StreamView)> &&callback) {
+        this->client_view_callback_.add(std::move(callback));
+    }
 
 protected:
+    friend class TraceReplay;
+    friend class MetricsEndpoint;
+    struct Client;
+    struct ProtocolFrame;
+
     void publish_sensor();
+    void diagnose();
+    bool sample_heap();
+    bool reallocate(size_t size);
+    void govern();
+    void generate();
+    void end_stage(uint8_t stage, uint32_t &start) {
+        if (!metrics_enabled_)
+            return;
+        uint32_t now = esphome::micros();
+        this->stage_time_[stage] += now - start;
+        start = now;
+    }
 
     void accept();
+    void add_client(std::unique_ptr<esphome::socket::Socket> socket, const std::string &identifier,
+                    ClientPriority priority);
+    ClientPriority classify(const struct sockaddr *addr);
+    void connect();
+    bool resolve();
+#ifndef USE_HOST
+    static void dns_found(const char *name, const ip_addr_t *addr, void *arg);
+#endif
+    void schedule_connect();
+    void start_peer(Client &client);
+    size_t handshake(Client &client, const uint8_t *data, size_t len);
     void cleanup();
     void read();
     void flush();
+    void flush_client(Client &client, uint32_t now);
+    size_t select_changes(Client &client, uint32_t now);
+    void record_changes(Client &client, size_t from, size_t to);
     void write();
+    void merge();
+    void append_log(int level, const char *message);
+    void append_binlog(const uint8_t *record, size_t len);
+    void sink();
+    size_t frame_boundary(size_t from, size_t max);
 
-    // Add declaration for Modbus parsing
-    void parse_modbus_request(uint8_t *buf, ssize_t len);
+    void discard(size_t len);
 
-    std::vector<uint8_t> received_data_;  // This will store the received data
+    void init_client(Client &client);
+    void flush_channels(Client &client);
+    void demux(Client &client, const uint8_t *data, size_t len);
+    size_t extract_urgent(Client &client, uint8_t *data, size_t len);
+    bool send_control(Client &client, uint8_t type, uint8_t channel, uint16_t value);
+    void grant_credit(Client &client);
+    size_t channel_tail(uint8_t channel, size_t tail);
+    void channel_discard(uint8_t channel, size_t tail);
+
+    // Frame of a protocol handler coroutine: the Modbus TCP ADU that is being received.
+    struct ProtocolFrame {
+        bool used;
+        uint16_t resume;
+        uint16_t received;
+        uint16_t pdu_len;
+        uint8_t header[7];
+        uint8_t pdu[253];
+        uint8_t backlog_len;
+        uint8_t backlog[128];  // Data received after a request that waits for room for its response
+    };
+    void run_modbus(Client &client, ProtocolFrame &frame, const uint8_t *&data, size_t &len);
+    void handle_modbus_request(Client &client, const ProtocolFrame &frame);
+    uint8_t write_registers(uint16_t address, uint16_t count, const uint8_t *values);
+    void set_register(RegisterImage &image, uint16_t address, RegisterFormat format, float value);
+    static bool take(uint8_t *dest, uint16_t need, uint16_t &received, const uint8_t *&data, size_t &len);
+
+    std::vector<uint8_t> received_data_;  // Data received from clients, not yet handed to the consumers
+    esphome::CallbackManager<void(const uint8_t *, size_t)> client_data_callback_{};
+    esphome::CallbackManager<void(uint32_t, const std::string &)> client_connected_callback_{};
+    esphome::CallbackManager<void(uint32_t, const std::string &)> client_disconnected_callback_{};
+    esphome::CallbackManager<void(uint32_t, StreamView)> client_view_callback_{};
+    esphome::CallbackManager<void()> break_callback_{};
 
     size_t buf_index(size_t pos) { return pos & (this->buf_size_ - 1); }
     size_t buf_ahead(size_t pos) { return (pos | (this->buf_size_ - 1)) - pos + 1; }
 
+    // Bounded queue of messages for a single client, in preallocated slots.
+    struct ControlQueue {
+        static constexpr uint8_t SLOTS = 4;
+        static constexpr uint16_t SLOT_SIZE = 260;  // Fits a Modbus TCP ADU
+
+        bool empty() const { return this->count == 0; }
+        bool full() const { return this->count == SLOTS; }
+        bool push(const uint8_t *message, size_t len);
+        int fill(struct iovec *iov) const;
+        size_t consume(size_t len);
+
+        uint8_t data[SLOTS][SLOT_SIZE];
+        uint16_t len[SLOTS];
+        uint16_t sent{0};
+        uint8_t head{0};
+        uint8_t count{0};
+    };
+
+    // Writes are sized in whole TCP segments, up to the estimated free space in the send buffer of the socket. On the host,
+    // TCP_MSS is the legacy constant of <netinet/tcp.h>, not the segment size of the stack, so it isn't used there.
+#if defined(TCP_MSS) && !defined(USE_HOST)
+    static constexpr size_t SEGMENT_SIZE = TCP_MSS;
+#else
+    static constexpr size_t SEGMENT_SIZE = 1436;
+#endif
+    static constexpr size_t INITIAL_SEND_SPACE = 4 * SEGMENT_SIZE;
+    static constexpr size_t MAX_SEND_SPACE = 16 * SEGMENT_SIZE;
+
     struct Client {
         Client(std::unique_ptr<esphome::socket::Socket> socket, std::string identifier, size_t position);
 
         std::unique_ptr<esphome::socket::Socket> socket{nullptr};
         std::string identifier{};
+        uint32_t number{0};  // Identifies the client in the binary log
         bool disconnected{false};
+        ClientPriority priority{ClientPriority::NORMAL};
+        bool outbound{false};
+        bool connecting{false};
+        bool congested{false};
+        bool handshaking{false};
+        bool iac{false};
+        int8_t slot{-1};
+        bool changes_only{false};
+        uint16_t hashes_valid{0};
+        uint32_t hashes[16];
+        std::unique_ptr<TimerWheel::Timer> keyframe{new TimerWheel::Timer()};
+        uint8_t handshake[6];
+        uint8_t handshake_len{0};
+        std::unique_ptr<TimerWheel::Timer> deadline{new TimerWheel::Timer()};
         size_t position{0};
+        size_t send_space{INITIAL_SEND_SPACE};
+        std::unique_ptr<ControlQueue> control{new ControlQueue()};
+
+        // Multiplexing state, see add_channel().
+        struct Channel {
+            size_t position;
+            size_t credit;
+            size_t consumed;  // Bytes handed to the channel that weren't granted back to the peer yet
+        };
+        std::vector<Channel> channels{};
+        uint8_t next_channel{0};
+        uint8_t tx_channel{0};
+        uint8_t tx_header[3];
+        uint8_t tx_header_sent{0};
+        size_t tx_remaining{0};
+        uint8_t rx_header[3];
+        uint8_t rx_header_len{0};
+        size_t rx_remaining{0};
+        uint8_t rx_control[4];  // Payload of a control message, collected across reads
+        uint8_t rx_control_len{0};
     };
 
+    static constexpr uint8_t MAX_CHANNELS = 15;
+    static constexpr size_t CHANNEL_QUANTUM = 512;
+    static constexpr uint8_t CONTROL_CREDIT = 0x01;
+
+    bool is_outbound() const { return !this->outbound_address_.empty(); }
+    bool has_sink() const { return this->sink_buf_ != nullptr && this->sink_publisher_ != nullptr; }
+    // Whether there is a peer connection, whose data is retained while it's disconnected.
+    bool has_peer() const { return this->is_outbound() || this->bridge_; }
+
+    static constexpr uint8_t BRIDGE_HELLO = 'H';
+    static constexpr uint8_t BRIDGE_SYNC = 'S';
+
     uint16_t port_;
     size_t buf_size_;
+    uint32_t next_client_number_{0};
+
+    std::string outbound_address_{};
+    uint16_t outbound_port_{0};
+    // Resolution of the outbound address. The lookup completes in the network stack, hence the atomic state.
+    enum class DnsState : uint8_t { IDLE, PENDING, RESOLVED, FAILED };
+    std::atomic<DnsState> dns_state_{DnsState::IDLE};
+    std::string outbound_ip_{};
+    uint32_t min_backoff_{1000};
+    uint32_t max_backoff_{300000};
+    TimerWheel::Timer connect_timer_{};
+    uint8_t connect_attempts_{0};
+    size_t outbound_position_{0};
+
+    bool bridge_{false};
+    uint32_t peer_offset_{0};
+    uint32_t bridge_gaps_{0};
+    esphome::HighFrequencyLoopRequester high_freq_{};
+
+    std::vector<StreamServerComponent *> channels_{};
+    StreamServerComponent *mux_{nullptr};
+    uint8_t channel_{0};
+    uint16_t channel_window_{4096};
+
+    bool has_urgent_{false};
+    bool telnet_urgent_{false};
+    uint32_t urgent_[8]{};
+
+    static constexpr uint8_t TELNET_IAC = 255;
+    static constexpr uint8_t TELNET_IP = 244;
+    static constexpr uint8_t TELNET_BRK = 243;
+
+    struct Frame {
+        size_t position;
+        size_t length;
+        uint32_t hash;
+        uint8_t type;
+    };
+    std::unique_ptr<Frame[]> frames_{};
+    size_t frames_size_{0};
+    size_t frames_count_{0};
+    size_t frame_start_{0};
+    bool changes_only_{false};
+    uint32_t keyframe_interval_{0};
+
+    struct Source {
+        std::unique_ptr<uint8_t[]> data;
+        size_t head;
+        size_t tail;
+        uint32_t dropped;
+    };
+    static constexpr size_t MERGE_QUANTUM = 256;
+    std::unique_ptr<Source[]> sources_{};
+    uint8_t sources_count_{0};
+    uint8_t next_source_{0};
+    size_t source_buffer_size_{0};
+    SourceTagging source_tagging_{SourceTagging::IN_BAND};
+    StreamServerComponent *merge_into_{nullptr};
+    uint8_t source_id_{0};
+
+    int log_level_{-1};
+    std::atomic<uint32_t> log_dropped_{0};  // Also counted by other tasks
+    uint32_t log_dropped_reported_{0};
+#ifdef USE_ESP32
+    TaskHandle_t main_task_{nullptr};  // Task of the main loop, the only one that may publish log lines
+#endif
+
+    static StreamServerComponent *binlog_server_;
+    bool binary_log_{false};
+    uint32_t binlog_dropped_{0};
+
+    std::unique_ptr<ProtocolFrame[]> protocol_frames_{};
+    uint8_t protocol_slots_{0};
+
+    struct HoldingRegister {
+        uint16_t address;
+        RegisterFormat format;
+        std::function<void(float)> write;
+        std::function<float()> read;
+    };
+    std::vector<HoldingRegister> holding_registers_{};
+    RegisterImage holding_image_{};
+    RegisterImage input_image_{};
+
+    std::string sink_topic_{};
+    std::function<bool(const std::string &, const uint8_t *, size_t)> sink_publisher_{};
+    std::unique_ptr<uint8_t[]> sink_buf_{};
+    size_t sink_position_{0};
+    size_t sink_batch_size_{0};
+    uint32_t sink_interval_{0};
+    TimerWheel::Timer sink_timer_{};
+    bool sink_waiting_{false};
+    bool sink_by_frame_{false};
+
+    struct PriorityRule {
+        uint32_t network;
+        uint32_t mask;
+        ClientPriority priority;
+    };
+    ClientPriority default_priority_{ClientPriority::NORMAL};
+    std::vector<PriorityRule> priority_rules_{};
+    uint32_t flush_budget_{0};
+    uint32_t loop_start_{0};
+
+    size_t batch_size_{0};
+    uint32_t batch_timeout_{0};
 
 #ifdef USE_BINARY_SENSOR
     esphome::binary_sensor::BinarySensor *connected_sensor_;
 #endif
 #ifdef USE_SENSOR
     esphome::sensor::Sensor *connection_count_sensor_;
+    esphome::sensor::Sensor *memory_usage_sensor_{nullptr};
+    esphome::sensor::Sensor *heap_largest_block_sensor_{nullptr};
+    esphome::sensor::Sensor *heap_fragmentation_sensor_{nullptr};
+    esphome::sensor::Sensor *memory_pressure_sensor_{nullptr};
+    esphome::sensor::Sensor *benchmark_throughput_sensor_{nullptr};
+    esphome::sensor::Sensor *benchmark_loop_time_sensor_{nullptr};
+    esphome::sensor::Sensor *benchmark_drop_rate_sensor_{nullptr};
+#endif
+    uint32_t diagnostics_interval_{0};
+    TimerWheel::Timer diagnostics_timer_{};
+    size_t heap_free_{0};
+    size_t heap_largest_block_{0};
+
+    size_t watermarks_[3]{};  // Largest free block below which each level above NORMAL starts
+    size_t ring_size_{0};     // Size of the ring when there is no memory pressure
+    // Under pressure the ring is halved on each pass of the governor, down to a quarter of its size, and no smaller than:
+    static constexpr size_t MIN_RING_SIZE = 256;
+    uint32_t governor_interval_{0};
+    TimerWheel::Timer governor_timer_{};
+    MemoryPressure pressure_{MemoryPressure::NORMAL};
+
+#ifdef USE_HOST
+    std::unique_ptr<TraceReplay> replay_{};
 #endif
 
+    // Benchmark records: 'B', 'M', sequence number, timestamp in us (both 32-bit little-endian), then 6 check bytes.
+    static constexpr size_t BENCHMARK_RECORD_SIZE = 16;
+    uint32_t benchmark_rate_{0};
+    uint32_t benchmark_last_{0};
+    uint64_t benchmark_credit_{0};  // In bytes * 10^6
+    uint32_t benchmark_sequence_{0};
+    uint32_t benchmark_dropped_{0};
+    uint32_t benchmark_reported_{0};
+    uint32_t benchmark_dropped_reported_{0};
+    uint64_t bytes_written_{0};
+    uint64_t bytes_read_{0};
+    uint64_t bytes_dropped_{0};
+    uint64_t bytes_written_reported_{0};
+    uint64_t loop_time_{0};
+    uint32_t loop_count_{0};
+    uint32_t diagnosed_{0};
+
+    static std::vector<StreamServerComponent *> instances_;
+    static bool metrics_enabled_;
+    std::unique_ptr<MetricsEndpoint> metrics_{};
+    // Stages of the loop: accept, read, write, flush and housekeeping.
+    static constexpr uint8_t LOOP_STAGES = 5;
+    uint64_t stage_time_[LOOP_STAGES]{};
+    static constexpr uint8_t LOOP_BUCKETS = 6;
+    static constexpr uint32_t LOOP_BUCKET_US[LOOP_BUCKETS] = {100, 500, 1000, 5000, 10000, 50000};
+    uint32_t loop_buckets_[LOOP_BUCKETS]{};
+    uint64_t loop_time_total_{0};
+    uint32_t loop_count_total_{0};
+
     std::unique_ptr<uint8_t[]> buf{};
     size_t buf_head_{0};
     size_t buf_tail_{0};
 
+    // Deadlines of this component and its clients.
+    TimerWheel timers_{};
+
     std::unique_ptr<esphome::socket::Socket> socket_{};
     std::vector<Client> clients_;
 };
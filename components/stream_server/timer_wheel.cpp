@@ -0,0 +1,90 @@
+#include "timer_wheel.h"
+
+void TimerWheel::Timer::cancel() {
+    if (this->pprev == nullptr)
+        return;
+
+    *this->pprev = this->next;
+    if (this->next != nullptr)
+        this->next->pprev = this->pprev;
+    this->next = nullptr;
+    this->pprev = nullptr;
+}
+
+void TimerWheel::schedule(Timer *timer, uint32_t now, uint32_t delay) {
+    if (!this->started_) {
+        this->current_ = now / TICK_MS;
+        this->started_ = true;
+    }
+
+    timer->cancel();
+    timer->expires = now + delay;
+    timer->expired = false;
+    this->insert(timer);
+}
+
+void TimerWheel::insert(Timer *timer) {
+    // Round up, so a timer never expires early. Timers beyond the range of the wheel are put in the last slot, and
+    // re-inserted when that slot is cascaded.
+    uint32_t tick = (timer->expires + TICK_MS - 1) / TICK_MS;
+    uint32_t delta = tick - this->current_;
+    if ((int32_t) delta <= 0)
+        tick = this->current_ + 1, delta = 1;
+
+    uint8_t level = 0;
+    while (level < LEVELS - 1 && delta >= (1UL << (SLOT_BITS * (level + 1))))
+        level++;
+    if (delta >= (1UL << (SLOT_BITS * LEVELS)))
+        tick = this->current_ + (1UL << (SLOT_BITS * LEVELS)) - 1;
+
+    Timer **head = &this->slots_[level][(tick >> (SLOT_BITS * level)) & SLOT_MASK];
+    timer->next = *head;
+    if (timer->next != nullptr)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+void TimerWheel::cascade(uint8_t level, uint32_t slot) {
+    Timer *timer = this->slots_[level][slot];
+    this->slots_[level][slot] = nullptr;
+    while (timer != nullptr) {
+        Timer *next = timer->next;
+        timer->next = nullptr;
+        timer->pprev = nullptr;
+        this->insert(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::advance(uint32_t now) {
+    if (!this->started_) {
+        this->current_ = now / TICK_MS;
+        this->started_ = true;
+        return;
+    }
+
+    uint32_t target = now / TICK_MS;
+    while ((int32_t) (target - this->current_) > 0) {
+        this->current_++;
+
+        // Move the timers of the next slot of the higher levels down, once the lower level has wrapped around.
+        for (uint8_t level = LEVELS - 1; level > 0; level--) {
+            if ((this->current_ & ((1UL << (SLOT_BITS * level)) - 1)) == 0)
+                this->cascade(level, (this->current_ >> (SLOT_BITS * level)) & SLOT_MASK);
+        }
+
+        Timer *timer = this->slots_[0][this->current_ & SLOT_MASK];
+        this->slots_[0][this->current_ & SLOT_MASK] = nullptr;
+        while (timer != nullptr) {
+            Timer *next = timer->next;
+            timer->next = nullptr;
+            timer->pprev = nullptr;
+            if ((int32_t) (now - timer->expires) >= 0)
+                timer->expired = true;
+            else
+                this->insert(timer);  // Beyond the range of the wheel when it was scheduled
+            timer = next;
+        }
+    }
+}
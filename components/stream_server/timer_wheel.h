@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+// Hierarchical timer wheel, with O(1) scheduling and cancellation of timers. Timers are intrusive, so the wheel never
+// allocates; the owner of a timer must keep it at a stable address while it's scheduled. advance() is called once per
+// loop, and marks all timers that have expired since the previous call.
+class TimerWheel {
+public:
+    struct Timer {
+        ~Timer() { this->cancel(); }
+
+        bool scheduled() const { return this->pprev != nullptr; }
+        void cancel();
+
+        Timer *next{nullptr};
+        Timer **pprev{nullptr};
+        uint32_t expires{0};
+        bool expired{false};
+    };
+
+    void schedule(Timer *timer, uint32_t now, uint32_t delay);
+    void advance(uint32_t now);
+
+protected:
+    static constexpr uint32_t TICK_MS = 4;
+    static constexpr uint8_t LEVELS = 3;
+    static constexpr uint8_t SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t SLOT_MASK = SLOTS - 1;
+
+    void insert(Timer *timer);
+    void cascade(uint8_t level, uint32_t slot);
+
+    Timer *slots_[LEVELS][SLOTS]{};
+    uint32_t current_{0};
+    bool started_{false};
+};
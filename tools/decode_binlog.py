@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Decode the binary log records served by a stream server with `binary_log` enabled.
+
+The format strings are read from the table in components/stream_server/binlog.h, so this tool must be used with the
+same version of that file as the firmware that produced the records.
+
+Usage: decode_binlog.py HOST[:PORT]    (connect to the stream server)
+       decode_binlog.py < records.bin  (decode a recorded stream)
+
+With --summary, the writes are summarized per port at the end instead: the throughput, and the number of writes per KB,
+which is an upper bound for the number of TCP segments per KB.
+"""
+
+import argparse
+import pathlib
+import re
+import socket
+import struct
+import sys
+
+HEADER = pathlib.Path(__file__).parent.parent / "components" / "stream_server" / "binlog.h"
+HEADER_SIZE = 5
+
+
+def load_formats(path):
+    text = path.read_text()
+    formats = re.findall(r'X\((\w+),\s*"((?:[^"\\]|\\.)*)"\)', text)
+    return [(name, fmt, len(re.findall(r"%[ux]", fmt))) for name, fmt in formats]
+
+
+def read_exact(stream, length):
+    data = b""
+    while len(data) < length:
+        chunk = stream(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+class Summary:
+    def __init__(self):
+        self.ports = {}
+
+    def add(self, name, timestamp, args):
+        if name != "WRITE":
+            return
+        written, port = args[:2]
+        first, last, writes, total = self.ports.get(port, (timestamp, timestamp, 0, 0))
+        self.ports[port] = (first, timestamp, writes + 1, total + written)
+
+    def write(self, out):
+        for port, (first, last, writes, total) in sorted(self.ports.items()):
+            duration = (last - first) / 1e6
+            rate = total / duration / 1024 if duration > 0 else 0
+            out.write(
+                f"Port {port}: {total} bytes in {writes} writes, {writes * 1024 / total:.2f} writes/KB, {rate:.1f} KB/s\n"
+            )
+
+
+def decode(stream, formats, out, summary=None):
+    while True:
+        header = read_exact(stream, HEADER_SIZE)
+        if header is None:
+            return
+        record_id, timestamp = struct.unpack("<BI", header)
+        if record_id >= len(formats):
+            out.write(f"Unknown record ID {record_id}, stream is out of sync\n")
+            return
+        name, fmt, argc = formats[record_id]
+        args = struct.unpack(f"<{argc}I", read_exact(stream, 4 * argc) or b"\0" * 4 * argc)
+        if summary is not None:
+            summary.add(name, timestamp, args)
+            continue
+        out.write(f"[{timestamp / 1e6:12.6f}] {name}: {fmt % args}\n")
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("address", nargs="?", help="address of the stream server, as host[:port]")
+    parser.add_argument("--header", type=pathlib.Path, default=HEADER, help="path to binlog.h")
+    parser.add_argument("--summary", action="store_true", help="summarize the writes per port, until interrupted")
+    args = parser.parse_args()
+
+    formats = load_formats(args.header)
+    summary = Summary() if args.summary else None
+    try:
+        if args.address:
+            host, _, port = args.address.partition(":")
+            connection = socket.create_connection((host, int(port or 6638)))
+            decode(connection.recv, formats, sys.stdout, summary)
+        else:
+            decode(sys.stdin.buffer.read, formats, sys.stdout, summary)
+    except KeyboardInterrupt:
+        pass
+    if summary is not None:
+        summary.write(sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
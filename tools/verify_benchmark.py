@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Receive and verify the records generated by a stream server with `benchmark` enabled.
+
+Each record is 16 bytes: "BM", a sequence number and a timestamp in microseconds (both 32-bit little-endian), and 6
+check bytes derived from the sequence number. Every second, the throughput, the number of missing records and the
+number of bytes that weren't part of a valid record are printed. Records are missing when the device couldn't generate
+them, or when the client fell behind and lost data.
+
+Usage: verify_benchmark.py HOST[:PORT]
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+RECORD_SIZE = 16
+
+
+def check_bytes(sequence):
+    return bytes(((sequence + i) * 0x9D) & 0xFF for i in range(10, RECORD_SIZE))
+
+
+def verify(connection, out):
+    data = b""
+    expected = None
+    received = missing = corrupt = total = 0
+    start = report = time.monotonic()
+    while True:
+        chunk = connection.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+        total += len(chunk)
+
+        offset = 0
+        while len(data) - offset >= RECORD_SIZE:
+            record = data[offset : offset + RECORD_SIZE]
+            sequence, _ = struct.unpack_from("<II", record, 2)
+            if record[:2] != b"BM" or record[10:] != check_bytes(sequence):
+                # Out of sync, e.g. after joining in the middle of a record: resynchronize on the next byte.
+                if expected is not None:
+                    corrupt += 1
+                offset += 1
+                continue
+            if expected is not None and sequence != expected:
+                missing += (sequence - expected) & 0xFFFFFFFF
+            expected = (sequence + 1) & 0xFFFFFFFF
+            received += 1
+            offset += RECORD_SIZE
+        data = data[offset:]
+
+        now = time.monotonic()
+        if now - report >= 1:
+            out.write(
+                f"{total / (now - start) / 1024:8.1f} KB/s, {received} records, {missing} missing, {corrupt} bytes out of sync\n"
+            )
+            out.flush()
+            report = now
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("address", help="address of the stream server, as host[:port]")
+    args = parser.parse_args()
+
+    host, _, port = args.address.partition(":")
+    connection = socket.create_connection((host, int(port or 6638)))
+    try:
+        verify(connection, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()